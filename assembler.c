@@ -1,8 +1,20 @@
 /* Full assembler driver: preassembler (.am) + first pass + second pass + outputs */
+#define _POSIX_C_SOURCE 200809L   /* fmemopen, open_memstream, pthreads */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>    /* sysconf */
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include "globals.h"
+#include "queue.h"
+#include "macrolib.h"
+#include "diag.h"
+#include "optable.h"   /* generated by gen_optable from opcodes.def */
 
 /* Local module headers */
 /* These modules are added in this refactor */
@@ -13,46 +25,254 @@ typedef struct Sym {
     char name[MAX_SYMBOL_LENGTH];
     int value;            /* absolute address */
     unsigned attrs;       /* bitmask: 1=data, 2=code, 4=extern, 8=entry */
+    int refd;             /* --gc-data: named by an operand or .entry */
+    int line;             /* .am line of the definition */
     struct Sym *next;
+    struct Sym *hnext;    /* chain in AsmState.sym_index */
 } Sym;
 
+#define SYM_BUCKETS 1024
+
 enum { ATTR_DATA = 1u, ATTR_CODE = 2u, ATTR_EXTERN = 4u, ATTR_ENTRY = 8u };
 
+/* --gc-data bookkeeping: a labelled data block runs up to the next label;
+   unlabelled data directives extend the block before them */
+typedef struct {
+    int start;     /* DC of the first word */
+    int line;      /* .am line of its first directive */
+    Sym *sym;      /* label of the block, NULL if the data has none */
+} GcBlock;
+
+/* A list of symbol names seen in first_pass (operand references, .entry) */
+typedef struct NameRef {
+    char name[64];
+    int line;
+    struct NameRef *next;
+} NameRef;
+
+/* --whole-program: .entry symbols of every module, by name */
+typedef struct GlobalSym {
+    const struct Sym *sym;
+    const char *module;   /* base name of the defining file */
+    struct GlobalSym *next;
+} GlobalSym;
+typedef struct GlobalSyms {
+    GlobalSym *index[SYM_BUCKETS];
+} GlobalSyms;
+
 typedef struct ExtRef {
     char name[MAX_SYMBOL_LENGTH];
     int address;                 /* absolute address of the word using the extern */
     struct ExtRef *next;
 } ExtRef;
 
+/* Image capacity in words (code image, explicit data words, data runs) */
+#define IMAGE_WORDS 4096
+
+/* Data image run: either explicit words stored in data[] or a zero-fill extent */
+typedef struct {
+    int offset;   /* DC of the first word in the run */
+    int count;    /* number of words covered */
+    int first;    /* index of the first explicit word in data[], -1 for zero fill */
+} DataRun;
+
+/* Streaming .ob writer: code words leave second_pass in blocks of OB_BLOCK */
+#define OB_BLOCK 256
+typedef struct {
+    FILE *fp;
+    char path[512];
+    int addr;                      /* address of buf[0] */
+    int n;                         /* words buffered */
+    unsigned short buf[OB_BLOCK];
+} ObSink;
+
+/* --serve: where a .am line starts in the code and data images */
+typedef struct {
+    int ic, dc;
+} LineAddr;
+
+/* --serve: a label operand word, re-resolved when symbols move */
+typedef struct {
+    int at;          /* code word (the low one in wide mode) */
+    int line;
+    char name[64];
+} Hole;
+
+/* In-memory output files (pipeline mode); NULL OutSet means real files */
+enum { OUT_AM, OUT_OB, OUT_ENT, OUT_EXT, OUT_SIZE, OUT_KINDS };
+typedef struct {
+    char *buf[OUT_KINDS];
+    size_t len[OUT_KINDS];
+    int present[OUT_KINDS];   /* 0: the file must not exist after writing */
+} OutSet;
+
+/* Encoding template: the symbol-independent encoding of one instruction
+   statement. Label operand words are holes filled in by second_pass
+   (two words per hole in wide-address mode). */
+#define TMPL_MAX_WORDS 7
+#define TMPL_MAX_HOLES 2
+#define ENC_BUCKETS 1024
+#define ENC_CACHE_MAX 4096   /* templates kept per file; beyond that, rebuilt */
+enum { ENC_OK = 0, ENC_BAD_OPERAND, ENC_BAD_COUNT, ENC_BAD_MODE };
+typedef struct EncTmpl {
+    char *key;                            /* normalized statement text */
+    int status;                           /* ENC_OK or why the statement is illegal */
+    int nwords;
+    unsigned short words[TMPL_MAX_WORDS]; /* holes are left as 0 */
+    int nholes;
+    int hole_word[TMPL_MAX_HOLES];        /* index into words[] of the (low) word */
+    char hole_name[TMPL_MAX_HOLES][64];   /* symbol whose address fills the hole */
+    struct EncTmpl *next;
+} EncTmpl;
+
+/* Code-size attribution (--size-report): words credited per .am line */
+typedef struct {
+    int words;
+    char kind[16];     /* directive or opcode */
+    char label[64];    /* enclosing label: last one defined at or above the line */
+} SizeLine;
+
+typedef struct {
+    SizeLine *lines;   /* indexed by .am line */
+    int cap;
+    int cur;           /* .am line being processed */
+    char label[64];    /* current enclosing label */
+    SrcMap map;        /* .am line -> .as line and macro */
+} SizeReport;
+
 typedef struct {
     /* images */
-    unsigned short code[4096];   /* 10-bit words stored in 16-bit */
-    unsigned short data[4096];
+    unsigned short code[IMAGE_WORDS];   /* machine words (up to 16 bits) */
+    unsigned short data[IMAGE_WORDS];   /* explicit data words only */
+    DataRun runs[IMAGE_WORDS];          /* data image in address order */
+    int nwords; /* explicit data words stored */
+    int nruns;  /* data runs used */
     int ic; /* number of code words */
-    int dc; /* number of data words */
+    int dc; /* number of data words (explicit + zero fill) */
+    /* streaming mode: code goes to sink, data records go to spill */
+    int stream;
+    int wide;          /* label operands take two words: low bits, high bits */
+    int warned_narrow; /* an address wider than one label word was truncated (not wide) */
+    ObSink *sink;
+    FILE *spill;  /* ints: >=0 explicit word, <0 zero run of -n words */
+    int spill_zeros;  /* zero words not yet in spill, merged into one run */
+    OutSet *outs; /* outputs go to memory when set */
+    SizeReport *size; /* NULL unless --size-report */
+    /* --gc-data */
+    int gc;
+    GcBlock *blocks;
+    int nblocks, cap_blocks;
+    NameRef *refs;
+    NameRef *entries;   /* .entry names, in reverse order */
+    /* --whole-program */
+    int code_base;      /* address of code word 0 */
+    const struct GlobalSyms *globals;  /* resolves .extern against other modules' .entry */
+    /* --serve: passes over part of a file, and what the next edit reuses */
+    int line_base;      /* .am line before the first one read */
+    int ic_base;        /* code word the second pass starts at */
+    int track;          /* record addrs and holes */
+    LineAddr *addrs;    /* per .am line read, plus one entry for the end */
+    int naddrs, cap_addrs;
+    Hole *holes;        /* in code order */
+    int nholes, cap_holes;
+    /* per-file encode cache, keyed by normalized statement text */
+    EncTmpl *enc_cache[ENC_BUCKETS];
+    int enc_count;
+    EncTmpl enc_scratch;   /* used once the cache is full */
+    long enc_lookups;
+    long enc_hits;
     /* tables */
     Sym *symbols;
+    Sym *sym_index[SYM_BUCKETS];
     ExtRef *extrefs;
     /* error state */
     int error_count;
+    Diag diag;   /* messages are buffered here and flushed once the file is done */
 } AsmState;
 
 /* ---- helpers (decls) ---- */
 static void state_init(AsmState *st);
 static void state_free(AsmState *st);
 static void sym_add(AsmState *st, const char *name, int value, unsigned attrs, int line);
-static Sym *sym_get(Sym *head, const char *name);
+static Sym *sym_get(const AsmState *st, const char *name);
 static void sym_mark_entry(AsmState *st, const char *name, int line);
 static void sym_add_extern(AsmState *st, const char *name, int line);
 static void sym_adjust_data(AsmState *st, int add);
+static void sym_adjust_code(AsmState *st, int add);
 static void ext_add(AsmState *st, const char *name, int address);
 
+/* --serve bookkeeping */
+static void line_addr(AsmState *st);
+static void hole_add(AsmState *st, int at, const char *name, int line);
+
+/* diagnostics */
+static void asm_error(AsmState *st, int line, const char *fmt, ...);
+static void asm_warn(AsmState *st, int line, const char *fmt, ...);
+
 /* passes */
-static int first_pass(const char *am_path, AsmState *st);
-static int second_pass(const char *am_path, AsmState *st);
+static int first_pass(FILE *fp, AsmState *st);
+static int second_pass(FILE *fp, AsmState *st);
+
+/* data image */
+static void data_word(AsmState *st, unsigned short w, int line);
+static void data_zero(AsmState *st, int count, int line);
+static void spill_flush(AsmState *st);
+
+/* code image */
+static void code_put(AsmState *st, int *ic, unsigned short w);
+
+/* unreferenced data elimination */
+static void gc_block(AsmState *st, const char *label, int line);
+static void gc_ref(AsmState *st, const char *name);
+static void name_push(NameRef **list, const char *name, int line);
+static int gc_data(AsmState *st);
+
+/* size report */
+static void size_note(AsmState *st, int line, const char *label, const char *tok);
+static void size_credit(AsmState *st, int words);
+static void size_write(const char *base, AsmState *st);
+
+/* --check */
+static void check_summary(const char *base, const AsmState *st, int ok);
+
+/* command line options */
+typedef struct {
+    int compact_zeros;   /* --compact-zeros: one .ob line per zero-fill run */
+    int stream;          /* --stream: bounded-memory .ob emission */
+    int pipeline;        /* --pipeline: overlap reading, assembly and writing */
+    int stats;           /* --stats: print per-file encode cache hit rate */
+    MacroLib *mlib;      /* -M lib: precompiled macro library, read-only */
+    int wide;            /* --wide: 16-bit label addresses (two words each) */
+    int size_report;     /* --size-report: credit words to source lines and macros */
+    int gc_data;         /* --gc-data: drop data blocks nothing refers to */
+    int whole_program;   /* --whole-program: link all inputs into one image */
+    const char *out_name;/* -o NAME: output base for --whole-program */
+    int max_errors;      /* --max-errors N: stop a file after N errors (0: no limit) */
+    int check;           /* --check: assemble in memory, write nothing, print a summary */
+    int serve;           /* --serve: keep files warm, reassemble edits read from stdin */
+    const char *watch;   /* --watch DIR: reassemble .as files in DIR as they are saved */
+} AsmOptions;
+
+/* driver */
+static int assemble_one(const char *base, FILE *in, OutSet *outs, const AsmOptions *opts);
+static int run_pipeline(char *files[], int nfiles, const AsmOptions *opts);
+static int assemble_program(char *files[], int nfiles, const AsmOptions *opts);
+static const Sym *global_get(const GlobalSyms *g, const char *name);
+static int serve(const AsmOptions *opts);
+static int watch(const char *dir, const AsmOptions *opts);
 
 /* output */
-static int write_outputs(const char *base, const AsmState *st);
+static int write_outputs(const char *base, const AsmState *st, const AsmOptions *opts);
+static void ob_header(FILE *fob, int ic, int dc, int wide, const AsmOptions *opts);
+static void ob_code(FILE *fob, const AsmState *st, int addr);
+static void ob_data(FILE *fob, const AsmState *st, int addr, const AsmOptions *opts);
+static void ob_word(FILE *fob, int addr, unsigned short w);
+static void ob_zeros(FILE *fob, int addr, int count, const AsmOptions *opts);
+static int ob_stream_open(const char *base, AsmState *st, const AsmOptions *opts);
+static int ob_stream_close(AsmState *st, const AsmOptions *opts);
+static void ob_stream_abort(AsmState *st);
+static FILE *out_open(OutSet *o, int kind, const char *path);
+static void out_discard(OutSet *o, int kind, const char *path);
 
 /* preassembler already provided (globals.h decls) */
 
@@ -60,106 +280,277 @@ static int write_outputs(const char *base, const AsmState *st);
 static void trim(char *s);
 static int is_blank_or_comment(const char *s);
 static int is_label_token(const char *tok);
-static int is_register_name(const char *s);
+static int reg_number(const char *s, int n);
 static int parse_int10(const char *s, int *out);
 static int starts_with(const char *s, const char *pfx);
 static char* find_first_quote(char *s);
 static char* find_last_quote(char *s);
 static int quote_len_at(const unsigned char *p);
 
-/* opcode and addressing */
-typedef enum { OP_MOV=0, OP_CMP, OP_ADD, OP_SUB, OP_NOT, OP_CLR, OP_LEA, OP_INC, OP_DEC, OP_JMP, OP_BNE, OP_RED, OP_PRN, OP_JSR, OP_RTS, OP_STOP, OP_INVALID=99 } OpCode;
+/* opcode and addressing (OpCode is generated into optable.h from opcodes.def) */
 typedef enum { ADDR_IMMEDIATE=0, ADDR_DIRECT=1, ADDR_MATRIX=2, ADDR_REGISTER=3, ADDR_INVALID=99 } AddrMode;
 static OpCode opcode_from_str(const char *s);
 static AddrMode addrmode_from_operand(const char *op);
 
-/* encoder */
-static unsigned short make_word10(unsigned short value);              /* mask to 10 bits */
-static unsigned short word_first(OpCode op, AddrMode src, AddrMode dst); /* ARE=00 */
-static unsigned short word_immediate(int imm);                        /* ARE=00 + 8-bit value */
-static unsigned short word_label(int address, int is_extern);         /* ARE: extern=01, reloc=10 */
-static unsigned short word_regs(int src_reg, int dst_reg);            /* shared reg word with ARE=00 */
+/* machine profile (machines.def): lexer, encoder and output routines
+   compiled once per profile with its widths as constants */
+typedef struct {
+    const char *name;
+    int base;        /* load address of code word 0 */
+    int addr_bits;   /* label bits in one operand word */
+    OpCode (*opcode)(const char *s);                           /* OP_INVALID if not on this machine */
+    int (*is_register)(const char *s);
+    unsigned short (*word_data)(int v);                        /* .data/.string/.mat word */
+    unsigned short (*word_immediate)(int imm);                 /* ARE=00 + value */
+    unsigned short (*word_label)(int address, int is_extern);  /* ARE: extern=01, reloc=10 */
+    unsigned short (*word_regs)(int src_reg, int dst_reg);     /* shared reg word with ARE=00 */
+    void (*put_word)(unsigned short w, char out[16]);          /* base-4 unique, fixed width */
+    void (*put_addr)(int addr, char out[16]);                  /* base-4 unique, no leading zeros */
+} Machine;
+
+static const Machine *machine_find(const char *name);
+static void machine_list(FILE *out);
+static const Machine *machine;   /* --machine=NAME; set before any file is read */
 
-/* base-4 unique encoding */
-static void to_base4a(unsigned short w10, char out[6]); /* 5 chars + NUL using a,b,c,d */
-static void to_base4a_addr(int addr, char out[16]);     /* up to 16 for safety */
+/* encode cache */
+static const EncTmpl *encode_lookup(AsmState *st, OpCode op, const char *opname, char *rest);
+static void encode_build(EncTmpl *t, OpCode op, const char *op1, const char *op2, int wide);
+static void tmpl_hole(EncTmpl *t, const char *name, int wide);
+static void tmpl_operand(EncTmpl *t, AddrMode mode, const char *opnd, int is_src, int wide);
+static void encode_emit(AsmState *st, const EncTmpl *t, int *ic, int line);
 
 /* ---- main driver ---- */
 int main(int argc, char *argv[]) {
     int i;
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <input1> [input2 ...] (omit .as)\n", argv[0]);
+    int nfiles = 0;
+    int built = 0;
+    int failed = 0;
+    char **files;
+    const char *mlib_path = NULL;
+    AsmOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    files = (char**)calloc(argc, sizeof(char*));
+    if (!files) { fprintf(stderr, "Error: out of memory\n"); return ERROR; }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compact-zeros") == 0) opts.compact_zeros = 1;
+        else if (strcmp(argv[i], "--stream") == 0) opts.stream = 1;
+        else if (strcmp(argv[i], "--pipeline") == 0) opts.pipeline = 1;
+        else if (strcmp(argv[i], "--stats") == 0) opts.stats = 1;
+        else if (strcmp(argv[i], "--wide") == 0) opts.wide = 1;
+        else if (strcmp(argv[i], "--size-report") == 0) opts.size_report = 1;
+        else if (strcmp(argv[i], "--gc-data") == 0) opts.gc_data = 1;
+        else if (strcmp(argv[i], "--whole-program") == 0) opts.whole_program = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) opts.out_name = argv[++i];
+        else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) opts.max_errors = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--check") == 0) opts.check = 1;
+        else if (strcmp(argv[i], "--serve") == 0) opts.serve = 1;
+        else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) opts.watch = argv[++i];
+        else if (starts_with(argv[i], "--machine=")) {
+            machine = machine_find(argv[i] + 10);
+            if (!machine) {
+                fprintf(stderr, "Error: unknown machine %s; known:", argv[i] + 10);
+                machine_list(stderr);
+                free(files);
+                return ERROR;
+            }
+        }
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) mlib_path = argv[++i];
+        else if (strcmp(argv[i], "--build-mlib") == 0 && i + 2 < argc) {
+            if (!mlib_build(argv[i+1], argv[i+2])) { free(files); return ERROR; }
+            built++;
+            i += 2;
+        } else if (starts_with(argv[i], "-")) {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            free(files);
+            return ERROR;
+        } else files[nfiles++] = argv[i];
+    }
+    /* opened once all options are known: --check must not rebuild it on disk */
+    if (mlib_path) {
+        opts.mlib = mlib_open(mlib_path, !opts.check);
+        if (!opts.mlib) { free(files); return ERROR; }
+    }
+    if (opts.serve || opts.watch) {
+        const char *mode = opts.serve ? "--serve" : "--watch";
+        int ok = 0;
+        if (nfiles || opts.stream || opts.pipeline || opts.whole_program || opts.check || opts.gc_data || opts.size_report
+            || (opts.serve && opts.watch))
+            fprintf(stderr, "Error: %s takes no input files and works without --stream, --pipeline, --whole-program, --check, --gc-data, --size-report and %s\n",
+                    mode, opts.serve ? "--watch" : "--serve");
+        else ok = opts.serve ? serve(&opts) : watch(opts.watch, &opts);
+        mlib_close(opts.mlib);
+        free(files);
+        return ok ? OK : ERROR;
+    }
+    if (nfiles < 1) {
+        free(files);
+        if (built) return OK;
+        fprintf(stderr, "Usage: %s [--compact-zeros] [--stream] [--pipeline] [--stats] [--wide] [--size-report] [--gc-data] [--whole-program [-o name]] [--max-errors N] [--check] [--machine=NAME] [-M lib] <input1> [input2 ...] (omit .as)\n"
+                        "       %s --build-mlib <lib> <macros.as>\n"
+                        "       %s --serve [--wide] [--max-errors N] [-M lib]   (commands on stdin)\n"
+                        "       %s --watch <dir> [--wide] [--max-errors N] [-M lib]\n", argv[0], argv[0], argv[0], argv[0]);
         return ERROR;
     }
 
-    for (i = 1; i < argc; i++) {
+    if (opts.check && (opts.stream || opts.pipeline || opts.whole_program)) {
+        fprintf(stderr, "Error: --check cannot be combined with --stream, --pipeline or --whole-program\n");
+        mlib_close(opts.mlib);
+        free(files);
+        return ERROR;
+    }
+    if (opts.whole_program) {
+        if (opts.stream || opts.pipeline) {
+            fprintf(stderr, "Error: --whole-program cannot be combined with --stream or --pipeline\n");
+            mlib_close(opts.mlib);
+            free(files);
+            return ERROR;
+        }
+        assemble_program(files, nfiles, &opts);
+        mlib_close(opts.mlib);
+        free(files);
+        return OK;
+    }
+    if (opts.pipeline) {
+        run_pipeline(files, nfiles, &opts);
+        mlib_close(opts.mlib);
+        free(files);
+        return OK;
+    }
+    for (i = 0; i < nfiles; i++) {
         char as_name[512];
-        char am_name[512];
-        char base_name[512];
-        FILE *in = NULL, *am = NULL;
-        AsmState st;
-        size_t blen;
-
-        /* build names */
-        sprintf(base_name, "%s", argv[i]);
-        blen = strlen(base_name);
-        if (blen + 3 >= sizeof(as_name) || blen + 3 >= sizeof(am_name)) {
-            fprintf(stderr, "Error: base name too long: %s\n", base_name);
+        FILE *in;
+        OutSet mem;   /* --check: the .am lives here, nothing reaches the disk */
+        if (strlen(files[i]) + 3 >= sizeof(as_name)) {
+            fprintf(stderr, "Error: base name too long: %s\n", files[i]);
+            failed++;
             continue;
         }
-        as_name[0] = '\0'; am_name[0] = '\0';
-        strcpy(as_name, base_name); strcat(as_name, ".as");
-        strcpy(am_name, base_name); strcat(am_name, ".am");
-
+        sprintf(as_name, "%s.as", files[i]);
         in = fopen(as_name, "r");
         if (!in) {
             fprintf(stderr, "Error: cannot open %s\n", as_name);
+            failed++;
             continue;
         }
-        am = fopen(am_name, "w");
-        if (!am) {
-            fprintf(stderr, "Error: cannot create %s\n", am_name);
-            fclose(in);
-            continue;
-        }
-
-        /* preassemble: expand macros to .am */
+        memset(&mem, 0, sizeof(mem));
+        if (!assemble_one(files[i], in, opts.check ? &mem : NULL, &opts)) failed++;
+        fclose(in);
         {
-            macro *macros = make_macro(in);
-            rewind(in);
-            process_file(in, am, macros);
+            int k;
+            for (k = 0; k < OUT_KINDS; k++) free(mem.buf[k]);
         }
-        fclose(in);
-        fclose(am);
+    }
+    mlib_close(opts.mlib);
+    free(files);
+    return opts.check && failed ? ERROR : OK;   /* exit status only matters to --check users */
+}
 
-        /* two passes */
-        state_init(&st);
-        if (!first_pass(am_name, &st)) {
-            fprintf(stderr, "Errors in first pass. Skipping %s\n", base_name);
+/* Preassemble and assemble one source. With outs set, .am/.ob/.ent/.ext are
+   built in memory for a writer to flush later; otherwise files are written. */
+static int assemble_one(const char *base_name, FILE *in, OutSet *outs, const AsmOptions *opts) {
+    char am_name[512];
+    FILE *am;
+    AsmState st;
+    SizeReport *size = NULL;
+    SrcMap map;         /* --check: .am line -> .as line, for diagnostics */
+    int ok = 0;
+
+    memset(&map, 0, sizeof(map));
+    sprintf(am_name, "%s.am", base_name);
+    am = out_open(outs, OUT_AM, am_name);
+    if (!am) {
+        fprintf(stderr, "Error: cannot create %s\n", am_name);
+        return 0;
+    }
+
+    if (opts->size_report) {
+        size = (SizeReport*)calloc(1, sizeof(SizeReport));
+        if (!size) { fprintf(stderr, "Error: out of memory\n"); fclose(am); return 0; }
+    }
+
+    /* preassemble: expand macros to .am */
+    {
+        macro *macros = make_macro(in);
+        rewind(in);
+        process_file(in, am, macros, opts->mlib, size ? &size->map : opts->check ? &map : NULL);
+    }
+    fclose(am);
+    am = outs ? fmemopen(outs->buf[OUT_AM], outs->len[OUT_AM], "r") : fopen(am_name, "r");
+    if (!am) {
+        fprintf(stderr, "Error: cannot open %s\n", am_name);
+        if (size) { free(size->map.lines); free(size); }
+        free(map.lines);
+        return 0;
+    }
+
+    /* two passes */
+    state_init(&st);
+    diag_init(&st.diag, am_name, opts->max_errors);
+    if (opts->check) {
+        /* no .am is written: point at the .as */
+        char as_name[512];
+        sprintf(as_name, "%.500s.as", base_name);
+        diag_origin(&st.diag, as_name, size ? &size->map : &map, 0);
+    }
+    diag_bind(&st.diag);
+    st.outs = outs;
+    st.size = size;
+    st.gc = opts->gc_data;
+    st.wide = opts->wide;
+    if (opts->stream) {
+        st.stream = 1;
+        st.spill = tmpfile();
+        if (!st.spill) {
+            fprintf(stderr, "Error: cannot create spill file for %s\n", base_name);
+            diag_bind(NULL);
+            fclose(am);
             state_free(&st);
-            continue;
+            free(map.lines);
+            return 0;
         }
-        /* adjust DATA symbols by ICF + 100 */
-        sym_adjust_data(&st, st.ic + 100);
-        if (!second_pass(am_name, &st)) {
-            fprintf(stderr, "Errors in second pass. Skipping %s\n", base_name);
-            state_free(&st);
-            continue;
+    }
+    if (!first_pass(am, &st)) {
+        diag_report(&st.diag, DIAG_NOTE, 0, "Errors in first pass. Skipping %s", base_name);
+    } else {
+        if (st.gc) {
+            int saved = gc_data(&st);
+            if (saved) printf("%s: --gc-data removed %d unreferenced data words\n", base_name, saved);
         }
-        if (!write_outputs(base_name, &st)) {
-            fprintf(stderr, "Failed writing outputs for %s\n", base_name);
-            state_free(&st);
-            continue;
+        /* adjust DATA symbols by ICF + load base */
+        sym_adjust_data(&st, st.ic + machine->base);
+        /* streaming: IC/DC are final, so the .ob header goes out before encoding */
+        if (!opts->stream || ob_stream_open(base_name, &st, opts)) {
+            rewind(am);
+            if (!second_pass(am, &st)) {
+                diag_report(&st.diag, DIAG_NOTE, 0, "Errors in second pass. Skipping %s", base_name);
+            } else if (opts->check) {
+                ok = 1;
+            } else if ((opts->stream && !ob_stream_close(&st, opts)) || !write_outputs(base_name, &st, opts)) {
+                diag_report(&st.diag, DIAG_NOTE, 0, "Failed writing outputs for %s", base_name);
+            } else {
+                if (st.size) size_write(base_name, &st);
+                ok = 1;
+            }
         }
-        state_free(&st);
     }
-    return OK;
+    if (opts->stats) {
+        printf("%s: encode cache %ld/%ld hits (%d templates)\n",
+               base_name, st.enc_hits, st.enc_lookups, st.enc_count);
+    }
+    diag_bind(NULL);
+    diag_flush(&st.diag, stderr);
+    if (opts->check) check_summary(base_name, &st, ok);
+    fclose(am);
+    state_free(&st);
+    free(map.lines);
+    return ok;
 }
 
 /* ================= Implementation (minimal, compliant with homework.txt) ================ */
 
 static void state_init(AsmState *st) {
     memset(st, 0, sizeof(*st));
+    st->code_base = machine->base;
 }
 static void state_free(AsmState *st) {
     Sym *s;
@@ -168,39 +559,68 @@ static void state_free(AsmState *st) {
     while (s) { Sym *n = s->next; free(s); s = n; }
     e = st->extrefs;
     while (e) { ExtRef *n = e->next; free(e); e = n; }
+    if (st->sink) ob_stream_abort(st);
+    if (st->spill) fclose(st->spill);
+    free(st->blocks);
+    while (st->refs) { NameRef *n = st->refs->next; free(st->refs); st->refs = n; }
+    while (st->entries) { NameRef *n = st->entries->next; free(st->entries); st->entries = n; }
+    diag_free(&st->diag);
+    free(st->addrs);
+    free(st->holes);
+    if (st->size) {
+        free(st->size->lines);
+        free(st->size->map.lines);
+        free(st->size);
+    }
+    {
+        int b;
+        for (b = 0; b < ENC_BUCKETS; b++) {
+            EncTmpl *t = st->enc_cache[b];
+            while (t) { EncTmpl *n = t->next; free(t->key); free(t); t = n; }
+        }
+    }
 }
 
-static Sym *sym_get(Sym *head, const char *name) {
-    for (; head; head = head->next) if (strcmp(head->name, name) == 0) return head;
+static unsigned sym_hash(const char *name) {
+    unsigned long h = 5381;
+    while (*name) h = h * 33u + (unsigned char)*name++;
+    return (unsigned)(h % SYM_BUCKETS);
+}
+static Sym *sym_get(const AsmState *st, const char *name) {
+    Sym *s;
+    for (s = st->sym_index[sym_hash(name)]; s; s = s->hnext) if (strcmp(s->name, name) == 0) return s;
     return NULL;
 }
 static void sym_add(AsmState *st, const char *name, int value, unsigned attrs, int line) {
     Sym *s;
-    if (sym_get(st->symbols, name)) {
-        fprintf(stderr, "[%d] error: duplicate symbol '%s'\n", line, name);
-        st->error_count++;
+    if (sym_get(st, name)) {
+        asm_error(st, line, "duplicate symbol '%s'", name);
         return;
     }
     s = (Sym*)calloc(1, sizeof(Sym));
     strncpy(s->name, name, MAX_SYMBOL_LENGTH-1);
     s->value = value;
     s->attrs = attrs;
+    s->line = line;
     s->next = st->symbols;
     st->symbols = s;
+    {
+        unsigned b = sym_hash(s->name);
+        s->hnext = st->sym_index[b];
+        st->sym_index[b] = s;
+    }
 }
 static void sym_mark_entry(AsmState *st, const char *name, int line) {
-    Sym *s = sym_get(st->symbols, name);
+    Sym *s = sym_get(st, name);
     if (!s) {
-        fprintf(stderr, "[%d] error: .entry refers to undefined symbol '%s'\n", line, name);
-        st->error_count++;
+        asm_error(st, line, ".entry refers to undefined symbol '%s'", name);
         return;
     }
     s->attrs |= ATTR_ENTRY;
 }
 static void sym_add_extern(AsmState *st, const char *name, int line) {
-    if (sym_get(st->symbols, name)) {
-        fprintf(stderr, "[%d] error: symbol '%s' already defined; cannot mark extern\n", line, name);
-        st->error_count++;
+    if (sym_get(st, name)) {
+        asm_error(st, line, "symbol '%s' already defined; cannot mark extern", name);
         return;
     }
     sym_add(st, name, 0, ATTR_EXTERN, line);
@@ -211,6 +631,126 @@ static void sym_adjust_data(AsmState *st, int add) {
         if (s->attrs & ATTR_DATA) s->value += add;
     }
 }
+static void sym_adjust_code(AsmState *st, int add) {
+    Sym *s;
+    for (s = st->symbols; s; s = s->next) {
+        if (s->attrs & ATTR_CODE) s->value += add;
+    }
+}
+/* Append one explicit data word, extending the current explicit run */
+static void data_word(AsmState *st, unsigned short w, int line) {
+    DataRun *last = st->nruns ? &st->runs[st->nruns-1] : NULL;
+    if (st->stream) {
+        int rec = w;
+        spill_flush(st);
+        fwrite(&rec, sizeof(rec), 1, st->spill);
+        st->dc++;
+        if (st->size) size_credit(st, 1);
+        return;
+    }
+    if (st->nwords >= IMAGE_WORDS || (!(last && last->first >= 0) && st->nruns >= IMAGE_WORDS)) {
+        asm_error(st, line, "data image full (%d words); use --stream", IMAGE_WORDS);
+        return;
+    }
+    if (!(last && last->first >= 0)) {
+        last = &st->runs[st->nruns++];
+        last->offset = st->dc;
+        last->count = 0;
+        last->first = st->nwords;
+    }
+    st->data[st->nwords++] = w;
+    last->count++;
+    st->dc++;
+    if (st->size) size_credit(st, 1);
+}
+/* Append a zero-fill extent; no words are materialized */
+static void data_zero(AsmState *st, int count, int line) {
+    DataRun *last = st->nruns ? &st->runs[st->nruns-1] : NULL;
+    if (count <= 0) return;
+    if (st->size) size_credit(st, count);
+    if (st->stream) {
+        st->spill_zeros += count;
+        st->dc += count;
+        return;
+    }
+    if (last && last->first < 0) {
+        last->count += count;
+    } else {
+        if (st->nruns >= IMAGE_WORDS) {
+            asm_error(st, line, "data image full (%d runs); use --stream", IMAGE_WORDS);
+            return;
+        }
+        last = &st->runs[st->nruns++];
+        last->offset = st->dc;
+        last->count = count;
+        last->first = -1;
+    }
+    st->dc += count;
+}
+/* Stream mode: write the pending zero run, as in-memory mode merges adjacent runs */
+static void spill_flush(AsmState *st) {
+    int rec = -st->spill_zeros;
+    if (!st->spill_zeros) return;
+    fwrite(&rec, sizeof(rec), 1, st->spill);
+    st->spill_zeros = 0;
+}
+/* Store one code word, or hand it to the stream sink in stream mode */
+static void code_put(AsmState *st, int *ic, unsigned short w) {
+    if (st->sink) {
+        ObSink *k = st->sink;
+        if (k->n == OB_BLOCK) {
+            int i;
+            for (i=0;i<k->n;i++) ob_word(k->fp, k->addr+i, k->buf[i]);
+            k->addr += k->n;
+            k->n = 0;
+        }
+        k->buf[k->n++] = w;
+    } else if (*ic < IMAGE_WORDS) {
+        st->code[*ic] = w;
+    }
+    (*ic)++;
+    if (st->size) size_credit(st, 1);
+}
+static void line_addr(AsmState *st) {
+    if (st->naddrs == st->cap_addrs) {
+        int cap = st->cap_addrs ? st->cap_addrs * 2 : 256;
+        LineAddr *na = (LineAddr*)realloc(st->addrs, cap * sizeof(LineAddr));
+        if (!na) { st->track = 0; asm_error(st, 0, "out of memory"); return; }
+        st->addrs = na;
+        st->cap_addrs = cap;
+    }
+    st->addrs[st->naddrs].ic = st->ic;
+    st->addrs[st->naddrs].dc = st->dc;
+    st->naddrs++;
+}
+static void hole_add(AsmState *st, int at, const char *name, int line) {
+    Hole *h;
+    if (st->nholes == st->cap_holes) {
+        int cap = st->cap_holes ? st->cap_holes * 2 : 256;
+        Hole *nh = (Hole*)realloc(st->holes, cap * sizeof(Hole));
+        if (!nh) { st->track = 0; asm_error(st, 0, "out of memory"); return; }
+        st->holes = nh;
+        st->cap_holes = cap;
+    }
+    h = &st->holes[st->nholes++];
+    h->at = at;
+    h->line = line;
+    h->name[0] = '\0';
+    strncat(h->name, name, sizeof(h->name) - 1);
+}
+static void asm_error(AsmState *st, int line, const char *fmt, ...) {
+    va_list ap;
+    st->error_count++;
+    va_start(ap, fmt);
+    diag_vreport(&st->diag, DIAG_ERROR, line, fmt, ap);
+    va_end(ap);
+}
+static void asm_warn(AsmState *st, int line, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vreport(&st->diag, DIAG_WARNING, line, fmt, ap);
+    va_end(ap);
+}
 static void ext_add(AsmState *st, const char *name, int address) {
     ExtRef *e = (ExtRef*)calloc(1, sizeof(ExtRef));
     strncpy(e->name, name, MAX_SYMBOL_LENGTH-1);
@@ -229,7 +769,6 @@ static void trim(char *s) {
 }
 static int is_blank_or_comment(const char *s) { while (*s==' '||*s=='\t') s++; return (*s==0)||(*s==';'); }
 static int is_label_token(const char *tok) { size_t n=strlen(tok); return n>1 && tok[n-1]==':'; }
-static int is_register_name(const char *s) { return strlen(s)==2 && s[0]=='r' && s[1]>='0' && s[1]<='7'; }
 static int parse_int10(const char *s, int *out) {
     char *end=NULL; long v = strtol(s, &end, 10); if (*s==0 || *end!=0) return 0; *out=(int)v; return 1;
 }
@@ -263,9 +802,8 @@ static int quote_len_at(const unsigned char *p) {
 /* opcodes */
 static OpCode opcode_from_str(const char *s) {
     int i;
-    static const char *names[] = {"mov","cmp","add","sub","not","clr","lea","inc","dec","jmp","bne","red","prn","jsr","rts","stop"};
-    for (i=0;i<16;i++) {
-        if (strcmp(s,names[i])==0) return (OpCode)i;
+    for (i=0;i<OP_COUNT;i++) {
+        if (strcmp(s,op_names[i])==0) return (OpCode)i;
     }
     return OP_INVALID;
 }
@@ -274,85 +812,125 @@ static AddrMode addrmode_from_operand(const char *op) {
     if (op[0]=='#') {
         int v; return parse_int10(op+1,&v)?ADDR_IMMEDIATE:ADDR_INVALID;
     }
-    if (is_register_name(op)) return ADDR_REGISTER;
+    if (machine->is_register(op)) return ADDR_REGISTER;
     if (strchr(op,'[')) return ADDR_MATRIX; /* simplistic detection */
     /* label */
     return ADDR_DIRECT;
 }
 
-/* encoding helpers (10-bit) */
-static unsigned short make_word10(unsigned short value) { return (unsigned short)(value & 0x03FFu); }
-static unsigned short word_first(OpCode op, AddrMode src, AddrMode dst) {
-    unsigned short v = 0;
-    v |= ((unsigned short)op & 0x0Fu) << 6;     /* bits 6-9 */
-    v |= ((unsigned short)src & 0x03u) << 4;    /* bits 4-5 */
-    v |= ((unsigned short)dst & 0x03u) << 2;    /* bits 2-3 */
-    v |= 0u;                                    /* ARE = 00 (Absolute) */
-    return make_word10(v);
-}
-static unsigned short word_immediate(int imm) {
-    unsigned short v = ((unsigned short)(imm) & 0x00FFu) << 2; /* 8-bit value, ARE=00 */
-    return make_word10(v);
-}
-static unsigned short word_label(int address, int is_extern) {
-    unsigned short are = is_extern ? 0x0001u : 0x0002u; /* 01=E, 10=R */
-    unsigned short v = ((unsigned short)(address) & 0x00FFu) << 2; /* low 8 bits of address */
-    v |= are;
-    return make_word10(v);
+/* ---- machine profiles ---- */
+
+#define OPBIT(op) (1u << (op))
+#define OPS_ALL ((1u << OP_COUNT) - 1u)
+
+/* Register number written as s, if below n; -1 otherwise */
+static int reg_number(const char *s, int n) {
+    int v;
+    if (s[0] < '0' || s[0] > '9') return -1;
+    v = s[0] - '0';
+    if (s[1]) {
+        if (v == 0 || s[1] < '0' || s[1] > '9' || s[2]) return -1;
+        v = v * 10 + (s[1] - '0');
+    }
+    return v < n ? v : -1;
 }
-static unsigned short word_regs(int src_reg, int dst_reg) {
-    unsigned short v = 0;
-    if (dst_reg>=0) v |= ((unsigned short)dst_reg & 0x0Fu) << 2;  /* bits 2-5 */
-    if (src_reg>=0) v |= ((unsigned short)src_reg & 0x0Fu) << 6;  /* bits 6-9 */
-    return make_word10(v);
+
+/* One set of routines per profile; bits, nregs, digits and ops are
+   constants inside each, so the masks and shifts fold at compile time */
+#define MACHINE(name, bits, base, nregs, digits, ops) \
+static OpCode name##_opcode(const char *s) { \
+    OpCode op = opcode_from_str(s); \
+    return op != OP_INVALID && ((ops) & OPBIT(op)) ? op : OP_INVALID; \
+} \
+static int name##_is_register(const char *s) { return s[0] == 'r' && reg_number(s + 1, nregs) >= 0; } \
+static unsigned short name##_word_data(int v) { \
+    return (unsigned short)((unsigned)v & ((1u << (bits)) - 1u)); \
+} \
+static unsigned short name##_word_immediate(int imm) { \
+    return (unsigned short)(((unsigned)imm & ((1u << ((bits) - 2)) - 1u)) << 2); \
+} \
+static unsigned short name##_word_label(int address, int is_extern) { \
+    return (unsigned short)((((unsigned)address & ((1u << ((bits) - 2)) - 1u)) << 2) | (is_extern ? 1u : 2u)); \
+} \
+static unsigned short name##_word_regs(int src_reg, int dst_reg) { \
+    unsigned v = 0; \
+    if (dst_reg >= 0) v |= ((unsigned)dst_reg & 0x0Fu) << 2; \
+    if (src_reg >= 0) v |= ((unsigned)src_reg & 0x0Fu) << 6; \
+    return (unsigned short)v; \
+} \
+static void name##_put_word(unsigned short w, char out[16]) { \
+    int i; \
+    for (i = (bits) / 2 - 1; i >= 0; i--) { out[i] = (digits)[w & 0x3u]; w >>= 2; } \
+    out[(bits) / 2] = '\0'; \
+} \
+static void name##_put_addr(int addr, char out[16]) { \
+    char tmp[16]; \
+    int i = 0, j = 0; \
+    if (addr == 0) tmp[i++] = (digits)[0]; \
+    while (addr > 0 && i < (int)sizeof(tmp) - 1) { tmp[i++] = (digits)[addr & 0x3]; addr >>= 2; } \
+    while (i > 0) out[j++] = tmp[--i]; \
+    out[j] = '\0'; \
 }
+#include "machines.def"
+#undef MACHINE
 
-static void to_base4a(unsigned short w10, char out[6]) {
-    /* 10 bits -> 5 base-4 digits (0..3). map 0,1,2,3 -> a,b,c,d */
+static const Machine machines[] = {
+#define MACHINE(name, bits, base, nregs, digits, ops) \
+    { #name, base, (bits) - 2, name##_opcode, name##_is_register, name##_word_data, name##_word_immediate, \
+      name##_word_label, name##_word_regs, name##_put_word, name##_put_addr },
+#include "machines.def"
+#undef MACHINE
+};
+
+static const Machine *machine = &machines[0];
+
+static const Machine *machine_find(const char *name) {
     int i;
-    const char map[4] = {'a','b','c','d'};
-    for (i=4;i>=0;i--) { out[i] = map[w10 & 0x3u]; w10 >>= 2; }
-    out[5] = '\0';
+    for (i = 0; i < (int)(sizeof(machines) / sizeof(machines[0])); i++)
+        if (strcmp(machines[i].name, name) == 0) return &machines[i];
+    return NULL;
 }
-static void to_base4a_addr(int addr, char out[16]) {
-    const char map[4] = {'a','b','c','d'};
-    char tmp[16];
-    int i=0;
-    int j=0;
-    if (addr==0) { out[0]='a'; out[1]='\0'; return; }
-    while (addr>0 && i<((int)sizeof(tmp))-1) { tmp[i++] = map[addr & 0x3]; addr >>= 2; }
-    while (i>0) { out[j++]=tmp[--i]; }
-    out[j]='\0';
+
+static void machine_list(FILE *out) {
+    int i;
+    for (i = 0; i < (int)(sizeof(machines) / sizeof(machines[0])); i++) fprintf(out, " %s", machines[i].name);
+    fputc('\n', out);
 }
 
 /* First pass: build symbol table, encode data/.string/.mat and count code length */
-static int first_pass(const char *am_path, AsmState *st) {
-    FILE *fp = fopen(am_path, "r");
-    if (!fp) { fprintf(stderr, "Error: cannot open %s\n", am_path); return 0; }
+static int first_pass(FILE *fp, AsmState *st) {
     {
         char linebuf[1024];
-        int line=0;
-        for (; fgets(linebuf,sizeof(linebuf),fp); ) {
+        char *tok_save;   /* strtok_r state: passes of different files may run concurrently */
+        int line=st->line_base;
+        for (; !diag_full(&st->diag) && fgets(linebuf,sizeof(linebuf),fp); ) {
             char work[1024];
             char *tok;
             char label_name[64]="";
             int has_label=0;
             line++;
+            if (st->track) line_addr(st);
             trim(linebuf);
             if (is_blank_or_comment(linebuf)) continue;
             strcpy(work, linebuf);
-            tok = strtok(work, " \t"); if (!tok) continue;
-            if (is_label_token(tok)) { has_label=1; tok[strlen(tok)-1]=0; strncpy(label_name,tok,63); tok = strtok(NULL, " \t"); if (!tok) { fprintf(stderr,"[%d] error: label without statement\n", line); st->error_count++; continue; } }
+            tok = strtok_r(work, " \t", &tok_save); if (!tok) continue;
+            if (is_label_token(tok)) { has_label=1; tok[strlen(tok)-1]=0; strncpy(label_name,tok,63); tok = strtok_r(NULL, " \t", &tok_save); if (!tok) { asm_error(st, line, "label without statement"); continue; } }
+            if (st->size) size_note(st, line, has_label ? label_name : NULL, tok);
         if (tok[0]=='.') {
             if (strcmp(tok, ".extern")==0 || starts_with(tok, ".extern")) {
                 char *name;
-                if (strlen(tok) > 7) name = (char*)tok + 7; else name = strtok(NULL, " \t");
+                if (strlen(tok) > 7) name = (char*)tok + 7; else name = strtok_r(NULL, " \t", &tok_save);
                 while (name && (*name==' '||*name=='\t')) name++;
-                if (!name || *name=='\0'){fprintf(stderr,"[%d] error: .extern missing name\n",line); st->error_count++; continue;}
+                if (!name || *name=='\0'){asm_error(st, line, ".extern missing name"); continue;}
                 sym_add_extern(st, name, line);
             } else if (strcmp(tok, ".entry")==0 || starts_with(tok, ".entry")) {
-                /* Defer marking to pass2; accept attached form .entryLABEL too */
-                /* No-op here */
+                /* Defer marking to pass2; accept attached form .entryLABEL too.
+                   The name is kept for --gc-data and --whole-program. */
+                char *name = strlen(tok) > 6 ? tok + 6 : strtok_r(NULL, " \t", &tok_save);
+                if (name) {
+                    name_push(&st->entries, name, line);
+                    if (st->gc) gc_ref(st, name);
+                }
             } else if (strcmp(tok, ".data")==0 || starts_with(tok, ".data")) {
                 char *p;
                 char *q;
@@ -360,8 +938,9 @@ static int first_pass(const char *am_path, AsmState *st) {
                 char save;
                 int val;
                 if (has_label) sym_add(st, label_name, st->dc, ATTR_DATA, line);
-                if (strlen(tok) > 5) p = (char*)tok + 5; else p = strtok(NULL, "");
-                if (!p){fprintf(stderr,"[%d] error: .data needs numbers\n",line); st->error_count++; continue;}
+                if (st->gc) gc_block(st, has_label ? label_name : NULL, line);
+                if (strlen(tok) > 5) p = (char*)tok + 5; else p = strtok_r(NULL, "", &tok_save);
+                if (!p){asm_error(st, line, ".data needs numbers"); continue;}
                 /* parse comma separated numbers */
                 q=p;
                 while (q && *q) {
@@ -370,8 +949,8 @@ static int first_pass(const char *am_path, AsmState *st) {
                     endptr=q;
                     while (*endptr && *endptr!=',') endptr++;
                     save=*endptr; *endptr='\0';
-                    if (!parse_int10(q,&val)) { fprintf(stderr,"[%d] error: invalid number in .data\n", line); st->error_count++; }
-                    else { st->data[st->dc++] = make_word10(((unsigned short)val)&0x03FFu); }
+                    if (!parse_int10(q,&val)) asm_error(st, line, "invalid number in .data");
+                    else { data_word(st, machine->word_data(val), line); }
                     *endptr=save; q = endptr;
                 }
             } else if (strcmp(tok, ".string")==0 || starts_with(tok, ".string")) {
@@ -382,278 +961,1825 @@ static int first_pass(const char *am_path, AsmState *st) {
                 int open_len;
                 int close_len;
                 /* include any text after .string including spaces */
-                if (strlen(tok) > 7) rest = (char*)tok + 7; else rest = strtok(NULL, "");
-                if (!rest){fprintf(stderr,"[%d] error: .string needs string\n",line); st->error_count++; continue;}
+                if (strlen(tok) > 7) rest = (char*)tok + 7; else rest = strtok_r(NULL, "", &tok_save);
+                if (!rest){asm_error(st, line, ".string needs string"); continue;}
                 /* find quotes in the original line (accept ASCII and Windows smart quotes) */
                 start = find_first_quote(linebuf);
                 endq = NULL;
                 if (start) endq = find_last_quote(start+1);
-                if (!start||!endq||endq<=start+1) { fprintf(stderr,"[%d] error: invalid .string\n", line); st->error_count++; continue; }
+                if (!start||!endq||endq<=start+1) { asm_error(st, line, "invalid .string"); continue; }
                 open_len = quote_len_at((const unsigned char*)start);
                 close_len = quote_len_at((const unsigned char*)endq);
-                if (open_len == 0 || close_len == 0) { fprintf(stderr,"[%d] error: invalid .string\n", line); st->error_count++; continue; }
+                if (open_len == 0 || close_len == 0) { asm_error(st, line, "invalid .string"); continue; }
                 if (has_label) sym_add(st, label_name, st->dc, ATTR_DATA, line);
-                for (pp=(unsigned char*)start+open_len; (char*)pp<endq; ++pp) st->data[st->dc++] = make_word10((*pp) & 0x03FFu);
-                st->data[st->dc++] = 0; /* NUL */
+                if (st->gc) gc_block(st, has_label ? label_name : NULL, line);
+                for (pp=(unsigned char*)start+open_len; (char*)pp<endq; ++pp) data_word(st, machine->word_data(*pp), line);
+                data_word(st, 0, line); /* NUL */
             } else if (strcmp(tok, ".mat")==0 || starts_with(tok, ".mat")) {
-                /* Minimal: allocate rows*cols cells (zero-init), optionally parse init list */
+                /* rows*cols cells: explicit init list, remainder kept as a zero-fill run */
                 char *rest;
                 int rows=0, cols=0;
                 int total;
                 int filled=0;
                 if (has_label) sym_add(st, label_name, st->dc, ATTR_DATA, line);
-                if (strlen(tok) > 4) rest = (char*)tok + 4; else rest = strtok(NULL, "");
+                if (st->gc) gc_block(st, has_label ? label_name : NULL, line);
+                if (strlen(tok) > 4) rest = (char*)tok + 4; else rest = strtok_r(NULL, "", &tok_save);
                 while (rest && (*rest==' '||*rest=='\t')) rest++;
-                if (!rest){fprintf(stderr,"[%d] error: .mat requires dims\n",line); st->error_count++; continue;}
-                if (sscanf(rest, "[%d][%d]", &rows, &cols)!=2 || rows<=0 || cols<=0){ fprintf(stderr,"[%d] error: .mat dims\n", line); st->error_count++; continue; }
+                if (!rest){asm_error(st, line, ".mat requires dims"); continue;}
+                if (sscanf(rest, "[%d][%d]", &rows, &cols)!=2 || rows<=0 || cols<=0){ asm_error(st, line, ".mat dims"); continue; }
+                if (rows > INT_MAX / cols) { asm_error(st, line, ".mat too large"); continue; }
                 total = rows*cols;
                 if (strchr(rest, ',')) {
                     char *list = strchr(rest, ',');
                     char *q2;
                     list++;
-                    q2=list; while (q2 && *q2 && filled<total) { while (*q2==' '||*q2=='\t'||*q2==',') q2++; if (!*q2) break; { char *e=q2; char sv; int v2; while (*e && *e!=',') e++; sv=*e; *e='\0'; if (parse_int10(q2,&v2)){ st->data[st->dc++] = make_word10(((unsigned short)v2)&0x03FFu); filled++; } else { fprintf(stderr,"[%d] error: invalid .mat init\n", line); st->error_count++; } *e=sv; q2=e; }
+                    q2=list; while (q2 && *q2 && filled<total) { while (*q2==' '||*q2=='\t'||*q2==',') q2++; if (!*q2) break; { char *e=q2; char sv; int v2; while (*e && *e!=',') e++; sv=*e; *e='\0'; if (parse_int10(q2,&v2)){ data_word(st, machine->word_data(v2), line); filled++; } else asm_error(st, line, "invalid .mat init"); *e=sv; q2=e; }
                     }
                 }
-                while (filled++ < total) st->data[st->dc++] = 0;
+                data_zero(st, total - filled, line);
             } else {
-                fprintf(stderr, "[%d] error: unknown directive '%s'\n", line, tok);
-                st->error_count++;
+                asm_error(st, line, "unknown directive '%s'", tok);
             }
         } else {
             /* instruction */
-            OpCode op = opcode_from_str(tok);
-            if (op==OP_INVALID) { fprintf(stderr, "[%d] error: unknown opcode '%s'\n", line, tok); st->error_count++; continue; }
-            if (has_label) sym_add(st, label_name, 100 + st->ic, ATTR_CODE, line);
-            /* parse operands */
+            OpCode op = machine->opcode(tok);
+            if (op==OP_INVALID) { asm_error(st, line, "unknown opcode '%s'", tok); continue; }
+            if (has_label) sym_add(st, label_name, machine->base + st->ic, ATTR_CODE, line);
+            /* length comes from the (cached) encoding template */
             {
-                char *rest;
-                char *comma;
-                char op1[64]="";
-                char op2[64]="";
-                int operands;
-                AddrMode src, dst;
-                int L;
-                rest = strtok(NULL, ""); if (!rest) rest = "";
-                comma = strchr(rest, ',');
-            if (comma) {
-                /* two operands */
-                *comma='\0'; trim(rest); trim(comma+1); strncpy(op1, rest, 63); strncpy(op2, comma+1, 63);
-            } else { trim(rest); if (*rest) strncpy(op1, rest, 63); }
-                operands = 0; if (*op1) operands++; if (*op2) operands++;
-            /* determine addressing */
-                src = ADDR_INVALID; dst = ADDR_INVALID;
-                if (operands==2) { src = addrmode_from_operand(op1); dst = addrmode_from_operand(op2); }
-                else if (operands==1) { src = 0; dst = addrmode_from_operand(op1); }
-                else { src=0; dst=0; }
-            /* instruction length counting (approx, without matrix full detail):
-               base word=1; each immediate/direct adds +1; registers may share +1 if both regs. */
-                L = 1;
-                if (operands==2) {
-                    /* compute instruction length */
-                    if (src==ADDR_IMMEDIATE || src==ADDR_DIRECT) L++;
-                    if (dst==ADDR_IMMEDIATE || dst==ADDR_DIRECT) L++;
-                    if (src==ADDR_REGISTER && dst==ADDR_REGISTER) L+=1;
-                    else if (src==ADDR_REGISTER) L+=1;
-                    else if (dst==ADDR_REGISTER) L+=1;
-                    if (src==ADDR_MATRIX) L+=2;
-                    if (dst==ADDR_MATRIX) L+=2; /* minimal allocation */
-                } else if (operands==1) {
-                    if (dst==ADDR_IMMEDIATE || dst==ADDR_DIRECT) L++;
-                    else if (dst==ADDR_REGISTER) L++;
-                    else if (dst==ADDR_MATRIX) L+=2;
-                }
-                st->ic += L;
+                char *rest = strtok_r(NULL, "", &tok_save);
+                const EncTmpl *t;
+                if (!rest) rest = "";
+                t = encode_lookup(st, op, tok, rest);
+                if (t->status == ENC_BAD_OPERAND) asm_error(st, line, "invalid operand for '%s'", tok);
+                else if (t->status == ENC_BAD_COUNT) asm_error(st, line, "wrong number of operands for '%s'", tok);
+                else if (t->status == ENC_BAD_MODE) asm_error(st, line, "illegal addressing mode for '%s'", tok);
+                st->ic += t->nwords;
             }
         }
     }
     }
-    fclose(fp);
+    if (st->track) line_addr(st);   /* end of the last line */
+    if (!st->stream && st->ic > IMAGE_WORDS) {
+        asm_error(st, 0, "code image full (%d words, limit %d); use --stream", st->ic, IMAGE_WORDS);
+    }
     return st->error_count==0;
 }
 
 /* Second pass: encode instructions fully and emit ext ref log */
-static int second_pass(const char *am_path, AsmState *st) {
-    FILE *fp = fopen(am_path, "r");
-    if (!fp) { fprintf(stderr, "Error: cannot open %s\n", am_path); return 0; }
+static int second_pass(FILE *fp, AsmState *st) {
     {
-        char linebuf[1024]; int line=0; int ic=0; /* ic counts words */
-        for (; fgets(linebuf,sizeof(linebuf),fp); ) {
+        char linebuf[1024]; int line=st->line_base; int ic=st->ic_base; /* ic counts words */
+        char *tok_save;
+        for (; !diag_full(&st->diag) && fgets(linebuf,sizeof(linebuf),fp); ) {
             char work[1024];
             char *tok;
             char *rest;
-            char *comma;
-            char op1[64]="";
-            char op2[64]="";
-            int operands;
-            AddrMode src, dst;
             OpCode op;
             line++; trim(linebuf); if (is_blank_or_comment(linebuf)) continue;
             strcpy(work, linebuf);
-            tok = strtok(work, " \t"); if (!tok) continue;
-            if (is_label_token(tok)) { tok = strtok(NULL, " \t"); if (!tok) continue; }
+            tok = strtok_r(work, " \t", &tok_save); if (!tok) continue;
+            if (is_label_token(tok)) { tok = strtok_r(NULL, " \t", &tok_save); if (!tok) continue; }
+            if (st->size) st->size->cur = line;
             if (tok[0]=='.') {
-                if (strcmp(tok, ".entry")==0) { char *name=strtok(NULL, " \t"); if (name) sym_mark_entry(st, name, line); }
+                if (strcmp(tok, ".entry")==0) { char *name=strtok_r(NULL, " \t", &tok_save); if (name) sym_mark_entry(st, name, line); }
                 continue; /* others already handled in pass1 */
             }
-        /* instruction */
-            op = opcode_from_str(tok);
-            rest = strtok(NULL, ""); if (!rest) rest = "";
-            comma = strchr(rest, ',');
-            if (comma) { *comma='\0'; trim(rest); trim(comma+1); strncpy(op1, rest, 63); strncpy(op2, comma+1, 63); }
-            else { trim(rest); if (*rest) strncpy(op1, rest, 63); }
-            operands = 0; if (*op1) operands++; if (*op2) operands++;
-            src = ADDR_INVALID; dst = ADDR_INVALID;
-            if (operands==2) { src = addrmode_from_operand(op1); dst = addrmode_from_operand(op2); }
-            else if (operands==1) { src = 0; dst = addrmode_from_operand(op1); }
-            else { src=0; dst=0; }
-        st->code[ic++] = word_first(op, src, dst);
-        /* encode operands */
-        if (operands==2) {
-            /* source */
-            if (src==ADDR_IMMEDIATE) {
-                int v; parse_int10(op1+1,&v); st->code[ic++] = word_immediate(v);
-            } else if (src==ADDR_DIRECT) {
-                Sym *s = sym_get(st->symbols, op1);
-                if (!s) { fprintf(stderr,"[%d] error: undefined symbol '%s'\n", line, op1); st->error_count++; s = NULL; }
-                {
-                    int ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                st->code[ic++] = word_label(s? s->value : 0, ext);
-                    if (ext) ext_add(st, op1, 100 + ic - 1);
-                }
-            } else if (src==ADDR_REGISTER) {
-                int sr = op1[1]-'0'; st->code[ic++] = word_regs(sr, -1);
-            } else if (src==ADDR_MATRIX) {
-                /* Minimal: treat like direct label + regs word (two regs rX][rY]) */
-                char label[64]; int rA=-1,rB=-1; Sym *s; int ext;
-                sscanf(op1, "%63[^[][%*1sr%d][%*1sr%d]", label, &rA, &rB);
-                s = sym_get(st->symbols, label);
-                ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                st->code[ic++] = word_label(s? s->value : 0, ext);
-                if (ext) ext_add(st, label, 100 + ic - 1);
-                st->code[ic++] = word_regs(rA, rB);
-            }
-            /* destination */
-            if (dst==ADDR_IMMEDIATE) {
-                int v; parse_int10(op2+1,&v); st->code[ic++] = word_immediate(v);
-            } else if (dst==ADDR_DIRECT) {
-                Sym *s = sym_get(st->symbols, op2);
-                if (!s) { fprintf(stderr,"[%d] error: undefined symbol '%s'\n", line, op2); st->error_count++; s = NULL; }
-                {
-                    int ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                    st->code[ic++] = word_label(s? s->value : 0, ext);
-                    if (ext) ext_add(st, op2, 100 + ic - 1);
-                }
-            } else if (dst==ADDR_REGISTER) {
-                int dr = op2[1]-'0';
-                /* if previous word was regs-only for src, merge: overwrite with combined */
-                if (src==ADDR_REGISTER) { ic--; st->code[ic++] = word_regs(op1[1]-'0', dr); }
-                else { st->code[ic++] = word_regs(-1, dr); }
-            } else if (dst==ADDR_MATRIX) {
-                char label[64]; int rA=-1,rB=-1; Sym *s; int ext;
-                sscanf(op2, "%63[^[][%*1sr%d][%*1sr%d]", label, &rA, &rB);
-                s = sym_get(st->symbols, label);
-                ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                st->code[ic++] = word_label(s? s->value : 0, ext);
-                if (ext) ext_add(st, label, 100 + ic - 1);
-                st->code[ic++] = word_regs(rA, rB);
-            }
-        } else if (operands==1) {
-            if (dst==ADDR_IMMEDIATE) { int v; parse_int10(op1+1,&v); st->code[ic++] = word_immediate(v); }
-            else if (dst==ADDR_DIRECT) {
-                Sym *s = sym_get(st->symbols, op1);
-                if (!s) { fprintf(stderr,"[%d] error: undefined symbol '%s'\n", line, op1); st->error_count++; s=NULL; }
-                {
-                    int ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                    st->code[ic++] = word_label(s? s->value : 0, ext);
-                    if (ext) ext_add(st, op1, 100 + ic - 1);
-                }
-            } else if (dst==ADDR_REGISTER) { int dr=op1[1]-'0'; st->code[ic++] = word_regs(-1, dr); }
-            else if (dst==ADDR_MATRIX) {
-                char label[64]; int rA=-1,rB=-1; Sym *s; int ext;
-                sscanf(op1, "%63[^[][%*1sr%d][%*1sr%d]", label, &rA, &rB);
-                s = sym_get(st->symbols, label);
-                ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
-                st->code[ic++] = word_label(s? s->value : 0, ext);
-                if (ext) ext_add(st, label, 100 + ic - 1);
-                st->code[ic++] = word_regs(rA, rB);
-            }
+            /* instruction: template built in pass1, only holes are resolved here */
+            op = machine->opcode(tok);
+            rest = strtok_r(NULL, "", &tok_save); if (!rest) rest = "";
+            encode_emit(st, encode_lookup(st, op, tok, rest), &ic, line);
         }
     }
-    }
-    fclose(fp);
     /* append data after code into final code image for output stage */
     /* Here we keep separate arrays and let writer print code then data */
     return st->error_count==0;
 }
 
-static int write_outputs(const char *base, const AsmState *st) {
-    /* .ob */
+/* Split operands, normalize the statement and return its encoding template,
+   building and caching it on the first occurrence. */
+static const EncTmpl *encode_lookup(AsmState *st, OpCode op, const char *opname, char *rest) {
+    char op1[64]="";
+    char op2[64]="";
+    char key[200];
+    char *comma;
+    unsigned long h = 5381;
+    const char *k;
+    EncTmpl *t;
+    comma = strchr(rest, ',');
+    if (comma) { *comma='\0'; trim(rest); trim(comma+1); strncpy(op1, rest, 63); strncpy(op2, comma+1, 63); }
+    else { trim(rest); if (*rest) strncpy(op1, rest, 63); }
+    sprintf(key, "%.15s %s,%s", opname, op1, op2);
+    for (k = key; *k; k++) h = h * 33u + (unsigned char)*k;
+    h %= ENC_BUCKETS;
+    st->enc_lookups++;
+    for (t = st->enc_cache[h]; t; t = t->next) {
+        if (strcmp(t->key, key) == 0) { st->enc_hits++; return t; }
+    }
+    t = NULL;
+    if (st->enc_count < ENC_CACHE_MAX) {
+        t = (EncTmpl*)calloc(1, sizeof(EncTmpl));
+        if (t) t->key = strdup(key);
+        if (t && !t->key) { free(t); t = NULL; }
+    }
+    if (!t) {
+        memset(&st->enc_scratch, 0, sizeof(st->enc_scratch));
+        t = &st->enc_scratch;
+        encode_build(t, op, op1, op2, st->wide);
+    } else {
+        encode_build(t, op, op1, op2, st->wide);
+        t->next = st->enc_cache[h];
+        st->enc_cache[h] = t;
+        st->enc_count++;
+    }
+    /* every distinct statement is built once, so its label holes are the references */
+    if (st->gc) {
+        int i;
+        for (i = 0; i < t->nholes; i++) gc_ref(st, t->hole_name[i]);
+    }
+    return t;
+}
+
+static void tmpl_hole(EncTmpl *t, const char *name, int wide) {
+    t->hole_word[t->nholes] = t->nwords;
+    strncpy(t->hole_name[t->nholes], name, 63);
+    t->nholes++;
+    t->words[t->nwords++] = 0;
+    if (wide) t->words[t->nwords++] = 0;
+}
+/* Encode one operand; for a source register shared with a destination
+   register, the caller emits the combined word instead. */
+static void tmpl_operand(EncTmpl *t, AddrMode mode, const char *opnd, int is_src, int wide) {
+    if (mode==ADDR_IMMEDIATE) {
+        int v; parse_int10(opnd+1,&v); t->words[t->nwords++] = machine->word_immediate(v);
+    } else if (mode==ADDR_DIRECT) {
+        tmpl_hole(t, opnd, wide);
+    } else if (mode==ADDR_REGISTER) {
+        int r = atoi(opnd+1);
+        t->words[t->nwords++] = is_src ? machine->word_regs(r, -1) : machine->word_regs(-1, r);
+    } else if (mode==ADDR_MATRIX) {
+        /* label word + regs word (two regs rX][rY]) */
+        char label[64]; int rA=-1,rB=-1;
+        label[0] = '\0';
+        sscanf(opnd, "%63[^[][%*1sr%d][%*1sr%d]", label, &rA, &rB);
+        tmpl_hole(t, label, wide);
+        t->words[t->nwords++] = machine->word_regs(rA, rB);
+    }
+}
+/* Classify the operands, then legality, length, register sharing and the
+   first word all come from one op_table entry */
+static void encode_build(EncTmpl *t, OpCode op, const char *op1, const char *op2, int wide) {
+    int operands = 0;
+    AddrMode src = 0, dst = 0;
+    const OpInfo *e;
+    if (*op1) operands++;
+    if (*op2) operands++;
+    if (operands==2) { src = addrmode_from_operand(op1); dst = addrmode_from_operand(op2); }
+    else if (operands==1) { dst = addrmode_from_operand(op1); }
+    t->nwords = 1;
+    if (src==ADDR_INVALID || dst==ADDR_INVALID) { t->status = ENC_BAD_OPERAND; return; }
+    if (operands != op_operands[op]) { t->status = ENC_BAD_COUNT; return; }
+    e = &op_table[op][src][dst][operands];
+    if (!e->legal) { t->status = ENC_BAD_MODE; return; }
+    t->words[0] = e->first;
+    if (e->shared) {
+        t->words[t->nwords++] = machine->word_regs(atoi(op1+1), atoi(op2+1));
+    } else if (operands==2) {
+        tmpl_operand(t, src, op1, 1, wide);
+        tmpl_operand(t, dst, op2, 0, wide);
+    } else if (operands==1) {
+        tmpl_operand(t, dst, op1, 0, wide);
+    }
+    /* the length is the table's; the operand words must have filled exactly that */
+    if (t->nwords != e->nwords + (wide ? e->nlabels : 0)) t->status = ENC_BAD_OPERAND;
+    t->nwords = e->nwords + (wide ? e->nlabels : 0);
+}
+/* Copy a template into the code image, resolving label holes and extern sites */
+static void encode_emit(AsmState *st, const EncTmpl *t, int *ic, int line) {
+    int i, h = 0;
+    for (i = 0; i < t->nwords; i++) {
+        if (h < t->nholes && t->hole_word[h] == i) {
+            const Sym *s = sym_get(st, t->hole_name[h]);
+            int ext = (s && (s->attrs & ATTR_EXTERN)) ? 1 : 0;
+            if (!s) asm_error(st, line, "undefined symbol '%s'", t->hole_name[h]);
+            if (ext && st->globals) {
+                /* linked image: the extern is another module's .entry */
+                s = global_get(st->globals, t->hole_name[h]);
+                ext = 0;
+                if (!s) asm_error(st, line, "unresolved extern '%s'", t->hole_name[h]);
+            }
+            if (s && !st->wide && s->value >> machine->addr_bits && !st->warned_narrow) {
+                asm_warn(st, line, "address of '%s' (%d) does not fit %d bits; use --wide", t->hole_name[h], s->value, machine->addr_bits);
+                st->warned_narrow = 1;
+            }
+            if (st->track) hole_add(st, *ic, t->hole_name[h], line);
+            code_put(st, ic, machine->word_label(s? s->value : 0, ext));
+            if (ext) ext_add(st, t->hole_name[h], st->code_base + *ic - 1);
+            if (st->wide) { code_put(st, ic, machine->word_label(s? s->value >> machine->addr_bits : 0, ext)); i++; }
+            h++;
+        } else {
+            code_put(st, ic, t->words[i]);
+        }
+    }
+}
+
+static int write_outputs(const char *base, const AsmState *st, const AsmOptions *opts) {
+    /* .ob (already written block by block in stream mode) */
     FILE *fob;
-    char b_ic[16], b_dc[16];
     char ob[512], ent[512], ext[512];
     sprintf(ob, "%s.ob", base);
     sprintf(ent, "%s.ent", base);
     sprintf(ext, "%s.ext", base);
-  fob = fopen(ob, "w");
-  
-    if (!fob) { fprintf(stderr,"Error: cannot create %s\n", ob); return 0; }
-    /* header: lengths in base-4 unique */
-    to_base4a_addr(st->ic, b_ic); to_base4a_addr(st->dc, b_dc);
-    fprintf(fob, "%s %s\n", b_ic, b_dc);
-    /* code */
-    {
-        int i;
-        for (i=0;i<st->ic;i++) {
-        char addr[16], word[6]; to_base4a_addr(100+i, addr); to_base4a(st->code[i], word);
-        fprintf(fob, "%s\t%s\n", addr, word);
-    }
-    /* data after code */
+    if (!opts->stream) {
+        fob = out_open(st->outs, OUT_OB, ob);
+        if (!fob) { fprintf(stderr,"Error: cannot create %s\n", ob); return 0; }
+        ob_header(fob, st->ic, st->dc, st->wide, opts);
+        ob_code(fob, st, machine->base);
+        ob_data(fob, st, machine->base + st->ic, opts);   /* data after code */
+        fclose(fob);
     }
-    {
-        int i;
-        for (i=0;i<st->dc;i++) {
-        char addr[16], word[6]; to_base4a_addr(100+st->ic+i, addr); to_base4a(st->data[i], word);
-        fprintf(fob, "%s\t%s\n", addr, word);
-    }
-    }
-    fclose(fob);
 
     /* .ent (only if at least one) */
     {
         int wrote_ent=0; FILE *fent=NULL; Sym *siter;
         for (siter=st->symbols; siter; siter=siter->next) {
             if (siter->attrs & ATTR_ENTRY) {
-                if (!fent){ fent=fopen(ent,"w"); if(!fent){fprintf(stderr,"Error: cannot create %s\n",ent); break;} }
+                if (!fent){ fent=out_open(st->outs, OUT_ENT, ent); if(!fent){fprintf(stderr,"Error: cannot create %s\n",ent); break;} }
                 {
                     char addr[16];
-                    to_base4a_addr(siter->value, addr);
+                    machine->put_addr(siter->value, addr);
                     fprintf(fent, "%s\t%s\n", siter->name, addr);
                     wrote_ent=1;
                 }
             }
         }
         if (fent) fclose(fent);
-        if (!wrote_ent) remove(ent);
+        if (!wrote_ent) out_discard(st->outs, OUT_ENT, ent);
     }
 
     /* .ext (only if at least one) */
     {
         int wrote_ext=0; FILE *fext=NULL; const ExtRef *e;
         for (e=st->extrefs; e; e=e->next){
-            if(!fext){ fext=fopen(ext,"w"); if(!fext){fprintf(stderr,"Error: cannot create %s\n",ext); break;} }
+            if(!fext){ fext=out_open(st->outs, OUT_EXT, ext); if(!fext){fprintf(stderr,"Error: cannot create %s\n",ext); break;} }
             {
                 char addr[16];
-                to_base4a_addr(e->address, addr);
+                machine->put_addr(e->address, addr);
                 fprintf(fext, "%s\t%s\n", e->name, addr);
                 wrote_ext=1;
             }
         }
         if (fext) fclose(fext);
-        if (!wrote_ext) remove(ext);
+        if (!wrote_ext) out_discard(st->outs, OUT_EXT, ext);
+    }
+
+    return 1;
+}
+
+
+
+
+/* header: lengths in base-4 unique, then layout flags if any
+   ('z' = compact zero runs, 'w' = wide label operands: low word, high word) */
+static void ob_header(FILE *fob, int ic, int dc, int wide, const AsmOptions *opts) {
+    char b_ic[16], b_dc[16], flags[4];
+    int n = 0;
+    machine->put_addr(ic, b_ic); machine->put_addr(dc, b_dc);
+    if (opts->compact_zeros) flags[n++] = 'z';
+    if (wide) flags[n++] = 'w';
+    flags[n] = '\0';
+    if (n) fprintf(fob, "%s %s %s\n", b_ic, b_dc, flags);
+    else fprintf(fob, "%s %s\n", b_ic, b_dc);
+}
+/* code image, word 0 at addr */
+static void ob_code(FILE *fob, const AsmState *st, int addr) {
+    int i;
+    for (i=0;i<st->ic;i++) ob_word(fob, addr+i, st->code[i]);
+}
+/* data image, DC 0 at addr */
+static void ob_data(FILE *fob, const AsmState *st, int addr, const AsmOptions *opts) {
+    int r, i;
+    for (r=0;r<st->nruns;r++) {
+        const DataRun *run = &st->runs[r];
+        if (run->first < 0) { ob_zeros(fob, addr+run->offset, run->count, opts); continue; }
+        for (i=0;i<run->count;i++) ob_word(fob, addr+run->offset+i, st->data[run->first+i]);
+    }
+}
+static void ob_word(FILE *fob, int addr, unsigned short w) {
+    char a[16], word[16];
+    machine->put_addr(addr, a); machine->put_word(w, word);
+    fprintf(fob, "%s\t%s\n", a, word);
+}
+/* zero run: expanded, or "<addr>\t*<count>" to be expanded by the loader */
+static void ob_zeros(FILE *fob, int addr, int count, const AsmOptions *opts) {
+    int i;
+    if (opts->compact_zeros) {
+        char a[16], cnt[16];
+        machine->put_addr(addr, a); machine->put_addr(count, cnt);
+        fprintf(fob, "%s\t*%s\n", a, cnt);
+        return;
+    }
+    for (i=0;i<count;i++) ob_word(fob, addr+i, 0);
+}
+
+/* Stream mode: open .ob and write the header; second_pass then feeds code_put */
+static int ob_stream_open(const char *base, AsmState *st, const AsmOptions *opts) {
+    ObSink *k = (ObSink*)calloc(1, sizeof(ObSink));
+    if (!k) { fprintf(stderr, "Error: out of memory\n"); return 0; }
+    sprintf(k->path, "%s.ob", base);
+    k->fp = out_open(st->outs, OUT_OB, k->path);
+    if (!k->fp) { fprintf(stderr, "Error: cannot create %s\n", k->path); free(k); return 0; }
+    k->addr = machine->base;
+    ob_header(k->fp, st->ic, st->dc, st->wide, opts);
+    st->sink = k;
+    return 1;
+}
+/* Flush the last code block, then append the data image from the spill file */
+static int ob_stream_close(AsmState *st, const AsmOptions *opts) {
+    ObSink *k = st->sink;
+    int i, rec, addr;
+    int ok;
+    for (i=0;i<k->n;i++) ob_word(k->fp, k->addr+i, k->buf[i]);
+    addr = machine->base + st->ic;
+    spill_flush(st);
+    rewind(st->spill);
+    while (fread(&rec, sizeof(rec), 1, st->spill) == 1) {
+        if (rec < 0) { ob_zeros(k->fp, addr, -rec, opts); addr += -rec; }
+        else ob_word(k->fp, addr++, (unsigned short)rec);
+    }
+    ok = !ferror(st->spill) && !ferror(k->fp);
+    if (fclose(k->fp) != 0) ok = 0;
+    if (!ok) out_discard(st->outs, OUT_OB, k->path);
+    free(k);
+    st->sink = NULL;
+    return ok;
+}
+/* Drop a partially written stream .ob (second pass failed) */
+static void ob_stream_abort(AsmState *st) {
+    fclose(st->sink->fp);
+    out_discard(st->outs, OUT_OB, st->sink->path);
+    free(st->sink);
+    st->sink = NULL;
+}
+
+/* Open an output: a real file, or a memory buffer when assembling into an OutSet */
+static FILE *out_open(OutSet *o, int kind, const char *path) {
+    if (!o) return fopen(path, "w");
+    free(o->buf[kind]);
+    o->buf[kind] = NULL;
+    o->len[kind] = 0;
+    o->present[kind] = 1;
+    return open_memstream(&o->buf[kind], &o->len[kind]);
+}
+/* Drop an output that must not exist (no entries/externs, or a failed write) */
+static void out_discard(OutSet *o, int kind, const char *path) {
+    if (!o) { remove(path); return; }
+    free(o->buf[kind]);
+    o->buf[kind] = NULL;
+    o->len[kind] = 0;
+    o->present[kind] = 0;
+}
+
+/* ---- pipelined driver: reader thread -> assembly (this thread) -> writer thread ---- */
+
+#define PIPE_DEPTH 4   /* sources prefetched / outputs pending; power of two */
+
+/* One source file travelling through the pipeline */
+typedef struct {
+    char base[512];
+    char *src;        /* whole .as contents, NULL if it could not be read */
+    size_t src_len;
+    int assembled;    /* outs holds a complete set of outputs */
+    OutSet outs;
+} Job;
+
+typedef struct {
+    char **files;
+    int nfiles;
+    SpscQueue to_asm;     /* reader -> assembly */
+    SpscQueue to_write;   /* assembly -> writer */
+} Pipeline;
+
+static char *read_all(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    char *buf = NULL;
+    size_t cap = 0, n = 0, got;
+    if (!fp) return NULL;
+    do {
+        if (n == cap) {
+            char *nb;
+            cap = cap ? cap * 2 : 4096;
+            nb = (char*)realloc(buf, cap);
+            if (!nb) { free(buf); fclose(fp); return NULL; }
+            buf = nb;
+        }
+        got = fread(buf + n, 1, cap - n, fp);
+        n += got;
+    } while (got > 0);
+    if (ferror(fp)) { free(buf); buf = NULL; }
+    fclose(fp);
+    *len = n;
+    return buf;
+}
+
+static void *reader_stage(void *arg) {
+    Pipeline *p = (Pipeline*)arg;
+    int i;
+    for (i = 0; i < p->nfiles; i++) {
+        Job *job = (Job*)calloc(1, sizeof(Job));
+        char as_name[520];
+        if (!job) break;
+        strncpy(job->base, p->files[i], sizeof(job->base) - 1);
+        sprintf(as_name, "%s.as", job->base);
+        job->src = read_all(as_name, &job->src_len);
+        spsc_push(&p->to_asm, job);
+    }
+    spsc_push(&p->to_asm, NULL);
+    return NULL;
+}
+
+static void *writer_stage(void *arg) {
+    static const char *exts[OUT_KINDS] = { ".am", ".ob", ".ent", ".ext", ".size" };
+    Pipeline *p = (Pipeline*)arg;
+    Job *job;
+    while ((job = (Job*)spsc_pop(&p->to_write)) != NULL) {
+        int k;
+        for (k = 0; k < OUT_KINDS; k++) {
+            char path[520];
+            sprintf(path, "%s%s", job->base, exts[k]);
+            if (job->outs.present[k]) {
+                FILE *fp = fopen(path, "w");
+                if (!fp || fwrite(job->outs.buf[k], 1, job->outs.len[k], fp) != job->outs.len[k])
+                    fprintf(stderr, "Error: cannot write %s\n", path);
+                if (fp) fclose(fp);
+            } else if (job->assembled && (k == OUT_ENT || k == OUT_EXT)) {
+                remove(path);
+            }
+            free(job->outs.buf[k]);
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+/* Assemble all files with source reads and output writes running in the
+   background, so I/O latency overlaps assembly even on a single core. */
+static int run_pipeline(char *files[], int nfiles, const AsmOptions *opts) {
+    Pipeline p;
+    pthread_t reader, writer;
+    Job *job;
+    p.files = files;
+    p.nfiles = nfiles;
+    if (!spsc_init(&p.to_asm, PIPE_DEPTH) || !spsc_init(&p.to_write, PIPE_DEPTH)) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 0;
+    }
+    if (pthread_create(&reader, NULL, reader_stage, &p) != 0) {
+        fprintf(stderr, "Error: cannot start reader thread\n");
+        return 0;
+    }
+    if (pthread_create(&writer, NULL, writer_stage, &p) != 0) {
+        fprintf(stderr, "Error: cannot start writer thread\n");
+        pthread_join(reader, NULL);
+        return 0;
+    }
+    while ((job = (Job*)spsc_pop(&p.to_asm)) != NULL) {
+        if (!job->src) {
+            fprintf(stderr, "Error: cannot open %s.as\n", job->base);
+        } else {
+            FILE *in = fmemopen(job->src, job->src_len, "r");
+            if (!in) fprintf(stderr, "Error: cannot open %s.as\n", job->base);
+            else {
+                job->assembled = assemble_one(job->base, in, &job->outs, opts);
+                fclose(in);
+            }
+            free(job->src);
+            job->src = NULL;
+        }
+        spsc_push(&p.to_write, job);
+    }
+    spsc_push(&p.to_write, NULL);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    spsc_free(&p.to_asm);
+    spsc_free(&p.to_write);
+    return 1;
+}
+
+/* ---- whole-program assembly ---- */
+
+typedef struct {
+    const char *base;
+    FILE *am;          /* expanded source, open for reading */
+    SizeReport *size;
+    AsmState st;
+    int ok;            /* result of the last pass run on this module */
+} Module;
+
+typedef struct {
+    Module *mods;
+    int nmods;
+    int next;          /* next module to claim (atomic) */
+    int pass;          /* 1 or 2 */
+} ModulePool;
+
+static void *module_worker(void *arg) {
+    ModulePool *pool = (ModulePool*)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->nmods) {
+        Module *m = &pool->mods[i];
+        rewind(m->am);
+        diag_bind(&m->st.diag);
+        m->ok = pool->pass == 1 ? first_pass(m->am, &m->st) : second_pass(m->am, &m->st);
+        diag_bind(NULL);
+    }
+    return NULL;
+}
+
+/* Run one pass over every module on up to one thread per online CPU */
+static void run_modules(Module *mods, int nmods, int pass) {
+    ModulePool pool;
+    pthread_t tids[16];
+    int nthreads = 4, started = 0, i;
+#ifdef _SC_NPROCESSORS_ONLN
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (nthreads > (int)(sizeof(tids) / sizeof(tids[0]))) nthreads = (int)(sizeof(tids) / sizeof(tids[0]));
+    if (nthreads > nmods) nthreads = nmods;
+    pool.mods = mods;
+    pool.nmods = nmods;
+    pool.next = 0;
+    pool.pass = pass;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[started], NULL, module_worker, &pool) != 0) break;
+        started++;
+    }
+    module_worker(&pool);   /* the calling thread works too */
+    for (i = 0; i < started; i++) pthread_join(tids[i], NULL);
+}
+
+static const Sym *global_get(const GlobalSyms *g, const char *name) {
+    const GlobalSym *e;
+    for (e = g->index[sym_hash(name) % SYM_BUCKETS]; e; e = e->next)
+        if (strcmp(e->sym->name, name) == 0) return e->sym;
+    return NULL;
+}
+
+/* Publish a module's .entry symbols; 0 if one is already exported elsewhere */
+static int global_add(GlobalSyms *g, Module *m) {
+    const NameRef *r;
+    int ok = 1;
+    for (r = m->st.entries; r; r = r->next) {
+        unsigned b = sym_hash(r->name) % SYM_BUCKETS;
+        const Sym *s = sym_get(&m->st, r->name);
+        GlobalSym *e;
+        if (!s || !(s->attrs & ATTR_ENTRY)) continue;   /* reported by sym_mark_entry */
+        for (e = g->index[b]; e; e = e->next)
+            if (strcmp(e->sym->name, r->name) == 0) break;
+        if (e) {
+            if (e->sym == s) continue;   /* same .entry listed twice */
+            asm_error(&m->st, r->line, "'%s' is already an entry of %s", r->name, e->module);
+            ok = 0;
+            continue;
+        }
+        e = (GlobalSym*)malloc(sizeof(GlobalSym));
+        if (!e) { fprintf(stderr, "Error: out of memory\n"); return 0; }
+        e->sym = s;
+        e->module = m->base;
+        e->next = g->index[b];
+        g->index[b] = e;
+    }
+    return ok;
+}
+
+static void global_free(GlobalSyms *g) {
+    int b;
+    for (b = 0; b < SYM_BUCKETS; b++) {
+        GlobalSym *e = g->index[b];
+        while (e) { GlobalSym *n = e->next; free(e); e = n; }
+    }
+}
+
+/* Preassemble one input to <base>.am and reopen it for the passes */
+static int module_open(Module *m, const AsmOptions *opts) {
+    char as_name[520], am_name[520];
+    FILE *in, *am;
+    sprintf(as_name, "%s.as", m->base);
+    sprintf(am_name, "%s.am", m->base);
+    in = fopen(as_name, "r");
+    if (!in) { fprintf(stderr, "Error: cannot open %s\n", as_name); return 0; }
+    am = fopen(am_name, "w");
+    if (!am) { fprintf(stderr, "Error: cannot create %s\n", am_name); fclose(in); return 0; }
+    if (opts->size_report) m->size = (SizeReport*)calloc(1, sizeof(SizeReport));
+    {
+        macro *macros = make_macro(in);
+        rewind(in);
+        process_file(in, am, macros, opts->mlib, m->size ? &m->size->map : NULL);
+    }
+    fclose(in);
+    fclose(am);
+    m->am = fopen(am_name, "r");
+    if (!m->am) { fprintf(stderr, "Error: cannot open %s\n", am_name); return 0; }
+    return 1;
+}
+
+/* Assemble every input into one image written to <out>.ob. Modules are
+   laid out in command-line order: all code, then all data. Each module's
+   first pass runs on its own, base addresses come from a prefix sum over
+   the module sizes, and .extern operands resolve to the .entry symbols of
+   the other modules, so no .ent/.ext files are produced. */
+static int assemble_program(char *files[], int nfiles, const AsmOptions *opts) {
+    const char *out = opts->out_name ? opts->out_name : files[0];
+    Module *mods;
+    GlobalSyms *globals;
+    int i, ok = 1, ic = 0, dc = 0;
+
+    mods = (Module*)calloc(nfiles, sizeof(Module));
+    globals = (GlobalSyms*)calloc(1, sizeof(GlobalSyms));
+    if (!mods || !globals) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(mods); free(globals);
+        return 0;
+    }
+    /* the preassembler is not reentrant: expand macros here, in order */
+    for (i = 0; i < nfiles; i++) {
+        Module *m = &mods[i];
+        m->base = files[i];
+        if (!module_open(m, opts)) { ok = 0; continue; }
+        state_init(&m->st);
+        {
+            char am_name[520];
+            sprintf(am_name, "%s.am", m->base);
+            diag_init(&m->st.diag, am_name, opts->max_errors);
+        }
+        m->st.size = m->size;
+        m->st.gc = opts->gc_data;
+        m->st.wide = opts->wide;
+        m->st.globals = globals;
+    }
+    if (ok) {
+        run_modules(mods, nfiles, 1);
+        for (i = 0; i < nfiles; i++) {
+            if (!mods[i].ok) { diag_report(&mods[i].st.diag, DIAG_NOTE, 0, "Errors in first pass of %s", mods[i].base); ok = 0; }
+        }
+    }
+    if (ok) {
+        /* address assignment: prefix sums of code sizes, then of data sizes */
+        for (i = 0; i < nfiles; i++) {
+            Module *m = &mods[i];
+            if (m->st.gc) {
+                int saved = gc_data(&m->st);
+                if (saved) printf("%s: --gc-data removed %d unreferenced data words\n", m->base, saved);
+            }
+            m->st.code_base = machine->base + ic;
+            sym_adjust_code(&m->st, ic);
+            ic += m->st.ic;
+        }
+        for (i = 0; i < nfiles; i++) {
+            sym_adjust_data(&mods[i].st, machine->base + ic + dc);
+            dc += mods[i].st.dc;
+        }
+        for (i = 0; i < nfiles; i++) {
+            const NameRef *r;
+            for (r = mods[i].st.entries; r; r = r->next) sym_mark_entry(&mods[i].st, r->name, r->line);
+            if (mods[i].st.error_count || !global_add(globals, &mods[i])) {
+                diag_report(&mods[i].st.diag, DIAG_NOTE, 0, "Errors in entries of %s", mods[i].base);
+                ok = 0;
+            }
+        }
+    }
+    if (ok) {
+        run_modules(mods, nfiles, 2);
+        for (i = 0; i < nfiles; i++) {
+            if (!mods[i].ok) { diag_report(&mods[i].st.diag, DIAG_NOTE, 0, "Errors in second pass of %s", mods[i].base); ok = 0; }
+        }
+    }
+    if (ok) {
+        char ob[520];
+        FILE *fob;
+        sprintf(ob, "%s.ob", out);
+        fob = fopen(ob, "w");
+        if (!fob) { fprintf(stderr, "Error: cannot create %s\n", ob); ok = 0; }
+        else {
+            int addr = machine->base + ic;
+            ob_header(fob, ic, dc, opts->wide, opts);
+            for (i = 0; i < nfiles; i++) ob_code(fob, &mods[i].st, mods[i].st.code_base);
+            for (i = 0; i < nfiles; i++) {
+                ob_data(fob, &mods[i].st, addr, opts);
+                addr += mods[i].st.dc;
+            }
+            fclose(fob);
+        }
+    }
+    for (i = 0; i < nfiles; i++) {
+        Module *m = &mods[i];
+        if (ok && m->st.size) size_write(m->base, &m->st);
+        if (opts->stats && m->am) {
+            printf("%s: encode cache %ld/%ld hits (%d templates)\n",
+                   m->base, m->st.enc_hits, m->st.enc_lookups, m->st.enc_count);
+        }
+        if (m->am) { diag_flush(&m->st.diag, stderr); fclose(m->am); state_free(&m->st); }
+        else if (m->size) { free(m->size->map.lines); free(m->size); }
+    }
+    if (!ok) fprintf(stderr, "Skipping %s.ob\n", out);
+    global_free(globals);
+    free(globals);
+    free(mods);
+    return ok;
+}
+
+/* ---- check-only mode ---- */
+
+/* One line per file on stdout, after its diagnostics */
+static void check_summary(const char *base, const AsmState *st, int ok) {
+    const Sym *s;
+    int nsyms = 0, nent = 0, next = 0;
+    if (!ok) {
+        printf("%s: failed, %d error%s\n", base, st->error_count, st->error_count == 1 ? "" : "s");
+        return;
+    }
+    for (s = st->symbols; s; s = s->next) {
+        nsyms++;
+        if (s->attrs & ATTR_ENTRY) nent++;
+        if (s->attrs & ATTR_EXTERN) next++;
+    }
+    printf("%s: ok, IC %d, DC %d, %d symbols (%d entry, %d extern)\n", base, st->ic, st->dc, nsyms, nent, next);
+}
+
+/* ---- incremental reassembly (--serve) ---- */
+
+/* --watch: an .entry and its address after the last good run */
+typedef struct Export {
+    char name[64];
+    int value;
+    struct Export *next;
+} Export;
+
+static void export_free(Export *e) {
+    while (e) { Export *n = e->next; free(e); e = n; }
+}
+
+/* A file kept warm between requests. Plain source lines map one to one to
+   .am lines, so an edit that touches no mcro block, macro call, .entry or
+   .extern is re-lexed on its own and spliced into the last run; anything
+   else reruns the whole file. */
+typedef struct Session {
+    char base[512];
+    macro *macros;      /* mcro definitions of the last full run */
+    char **am;          /* .am lines, without newlines */
+    int nam, cap_am;
+    SrcMap map;         /* .am line -> .as line */
+    int nsrc;           /* .as lines last seen */
+    char *src;          /* .as text last seen */
+    size_t src_len;
+    AsmState *st;       /* NULL when the next update must be a full run */
+    Export *exports;         /* --watch: .entry values of the last good run */
+    NameRef *imports;        /* --watch: its .extern names */
+    int built;               /* --watch: the two above are set */
+    struct Session *next;
+} Session;
+
+static void session_reset(Session *ss) {
+    int i;
+    while (ss->macros) {
+        macro *n = ss->macros->next;
+        free(ss->macros->mc_name); free(ss->macros->mc_data); free(ss->macros);
+        ss->macros = n;
+    }
+    for (i = 0; i < ss->nam; i++) free(ss->am[i]);
+    free(ss->am);
+    free(ss->map.lines);
+    if (ss->st) { state_free(ss->st); free(ss->st); }
+    ss->am = NULL; ss->nam = ss->cap_am = 0;
+    memset(&ss->map, 0, sizeof(ss->map));
+    ss->st = NULL;
+}
+
+static void session_free(Session *ss) {
+    session_reset(ss);
+    free(ss->src);
+    export_free(ss->exports);
+    while (ss->imports) { NameRef *n = ss->imports->next; free(ss->imports); ss->imports = n; }
+    free(ss);
+}
+
+/* The session of base in list, created at the end if missing; NULL when out of memory */
+static Session *session_get(Session **list, const char *base) {
+    Session **pp;
+    for (pp = list; *pp && strcmp((*pp)->base, base) != 0; pp = &(*pp)->next) ;
+    if (!*pp && (*pp = (Session*)calloc(1, sizeof(Session))) != NULL) strcpy((*pp)->base, base);
+    return *pp;
+}
+
+/* Split buf in place into lines; returns the count (a final unterminated line counts) */
+static int split_lines(char *buf, size_t len, char ***lines) {
+    int n = 0, cap = 0;
+    size_t i, start = 0;
+    *lines = NULL;
+    for (i = 0; i <= len; i++) {
+        if (i < len && buf[i] != '\n') continue;
+        if (i == len && start == len) break;
+        if (n == cap) {
+            char **nl;
+            cap = cap ? cap * 2 : 256;
+            nl = (char**)realloc(*lines, cap * sizeof(char*));
+            if (!nl) { free(*lines); *lines = NULL; return -1; }
+            *lines = nl;
+        }
+        if (i < len) buf[i] = '\0';
+        (*lines)[n++] = buf + start;
+        start = i + 1;
+    }
+    return n;
+}
+
+/* The .am form of a line without macro calls: tokens joined by one space */
+static void am_normalize(const char *src, char *out, size_t size) {
+    size_t n = 0;
+    while (*src) {
+        while (*src == ' ' || *src == '\t') src++;
+        if (!*src) break;
+        if (n && n + 1 < size) out[n++] = ' ';
+        while (*src && *src != ' ' && *src != '\t') {
+            if (n + 1 < size) out[n++] = *src;
+            src++;
+        }
+    }
+    out[n] = '\0';
+}
+
+/* Can this .am line be re-lexed without rerunning the preassembler? */
+static int line_is_plain(const Session *ss, const char *am, const AsmOptions *opts) {
+    char work[MAX_LINE_LEN], *tok, *save;
+    size_t len;
+    if (strstr(am, "mcro") || strstr(am, ".entry") || strstr(am, ".extern")) return 0;
+    strncpy(work, am, sizeof(work) - 1);
+    work[sizeof(work) - 1] = '\0';
+    for (tok = strtok_r(work, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (find_macro_data(ss->macros, tok)) return 0;
+        if (opts->mlib && mlib_find(opts->mlib, tok, &len)) return 0;
+    }
+    return 1;
+}
+
+static int session_write(Session *ss, const AsmOptions *opts) {
+    char am_name[520];
+    FILE *fp;
+    int i;
+    sprintf(am_name, "%s.am", ss->base);
+    fp = fopen(am_name, "w");
+    if (!fp) { fprintf(stderr, "Error: cannot create %s\n", am_name); return 0; }
+    for (i = 0; i < ss->nam; i++) { fputs(ss->am[i], fp); fputc('\n', fp); }
+    fclose(fp);
+    return write_outputs(ss->base, ss->st, opts);
+}
+
+/* Rebuild the .ext list from the holes; with relink, also rewrite every
+   label word from the current symbol values */
+static void session_patch(AsmState *st, int relink) {
+    int i;
+    ExtRef *e;
+    while ((e = st->extrefs) != NULL) { st->extrefs = e->next; free(e); }
+    for (i = 0; i < st->nholes; i++) {
+        const Hole *h = &st->holes[i];
+        const Sym *s = sym_get(st, h->name);
+        int ext = s && (s->attrs & ATTR_EXTERN);
+        if (!s) {
+            if (relink) asm_error(st, h->line, "undefined symbol '%s'", h->name);
+            continue;
+        }
+        if (relink) {
+            st->code[h->at] = machine->word_label(s->value, ext);
+            if (st->wide) st->code[h->at + 1] = machine->word_label(s->value >> machine->addr_bits, ext);
+        }
+        if (ext) ext_add(st, h->name, st->code_base + h->at);
+    }
+}
+
+/* Append src's data image words [off, off+count) to dst's image */
+static void data_copy(AsmState *dst, const AsmState *src, int off, int count) {
+    int r, i, end = off + count;
+    for (r = 0; r < src->nruns; r++) {
+        const DataRun *run = &src->runs[r];
+        int from = run->offset > off ? run->offset : off;
+        int to = run->offset + run->count < end ? run->offset + run->count : end;
+        if (to <= from) continue;
+        if (run->first < 0) data_zero(dst, to - from, 0);
+        else for (i = from; i < to; i++) data_word(dst, src->data[run->first + i - run->offset], 0);
+    }
+}
+
+static void session_reply(const Session *ss, const char *how, int ok, int errors) {
+    if (ok) printf("%s: ok (%s), IC %d, DC %d\n", ss->base, how, ss->st->ic, ss->st->dc);
+    else printf("%s: failed, %d error%s\n", ss->base, errors, errors == 1 ? "" : "s");
+}
+
+/* Text of m .am lines as one buffer, NULL if m is 0 */
+static char *lines_join(char **lines, int m, size_t *len) {
+    char *text = NULL;
+    FILE *out;
+    int k;
+    *len = 0;
+    if (!m || !(out = open_memstream(&text, len))) return NULL;
+    for (k = 0; k < m; k++) { fputs(lines[k], out); fputc('\n', out); }
+    fclose(out);
+    return text;
+}
+
+/* Preassemble and assemble the whole file, keeping everything an edit needs */
+static int session_full(Session *ss, const AsmOptions *opts) {
+    char as_name[520], am_name[520];
+    char *src, **lines;
+    size_t len;
+    OutSet mem;
+    FILE *in, *am;
+    AsmState *st;
+    int i, n, ok = 0, errors = 0;
+
+    session_reset(ss);
+    sprintf(as_name, "%s.as", ss->base);
+    sprintf(am_name, "%s.am", ss->base);
+    src = read_all(as_name, &len);
+    in = src && len ? fmemopen(src, len, "r") : NULL;
+    if (!src || (len && !in)) {
+        fprintf(stderr, "Error: cannot open %s\n", as_name);
+        free(src);
+        session_reply(ss, "full", 0, 1);
+        return 0;
+    }
+    memset(&mem, 0, sizeof(mem));
+    if (in) {
+        ss->macros = make_macro(in);
+        rewind(in);
+        am = out_open(&mem, OUT_AM, am_name);
+        if (am) {
+            process_file(in, am, ss->macros, opts->mlib, &ss->map);
+            fclose(am);
+        }
+        fclose(in);
+    }
+    ss->nsrc = 0;
+    for (i = 0; i < (int)len; i++) if (src[i] == '\n') ss->nsrc++;
+    if (len && src[len - 1] != '\n') ss->nsrc++;
+    free(ss->src);
+    ss->src = src;
+    ss->src_len = len;
+
+    /* keep the .am as lines for splicing */
+    n = mem.buf[OUT_AM] ? split_lines(mem.buf[OUT_AM], mem.len[OUT_AM], &lines) : 0;
+    if (n > 0) {
+        ss->am = (char**)malloc(n * sizeof(char*));
+        if (ss->am) {
+            for (i = 0; i < n; i++) ss->am[i] = strdup(lines[i]);
+            ss->nam = ss->cap_am = n;
+        }
+        free(lines);
+    }
+
+    st = (AsmState*)malloc(sizeof(AsmState));
+    if (!st) { fprintf(stderr, "Error: out of memory\n"); free(mem.buf[OUT_AM]); return 0; }
+    state_init(st);
+    diag_init(&st->diag, am_name, opts->max_errors);
+    diag_origin(&st->diag, as_name, &ss->map, 0);   /* .am is written only on success */
+    diag_bind(&st->diag);
+    st->wide = opts->wide;
+    st->track = 1;
+    {
+        size_t tlen;
+        char *text = lines_join(ss->am, ss->nam, &tlen);
+        FILE *fp = text ? fmemopen(text, tlen, "r") : NULL;
+        if (text && !fp) asm_error(st, 0, "out of memory");
+        else if (!fp) { line_addr(st); ok = 1; }   /* nothing to assemble */
+        else {
+            if (first_pass(fp, st)) {
+                sym_adjust_data(st, st->ic + machine->base);
+                rewind(fp);
+                if (second_pass(fp, st)) ok = 1;
+            }
+            fclose(fp);
+        }
+        free(text);
+    }
+    free(mem.buf[OUT_AM]);
+    ss->st = st;
+    if (ok && !session_write(ss, opts)) ok = 0;
+    diag_bind(NULL);
+    diag_flush(&st->diag, stderr);
+    errors = st->error_count;
+    if (ok) session_reply(ss, "full", 1, 0);
+    else {
+        session_reply(ss, "full", 0, errors);
+        state_free(st);
+        free(st);
+        ss->st = NULL;
+    }
+    return ok;
+}
+
+/* .as lines first..last of the last version were replaced (last = first-1:
+   lines were inserted before first) to give src, the new text. Returns the
+   new lines in .am form and the old .am range [lo, hi), or NULL if the edit
+   is not plain. */
+static char **session_lines(Session *ss, const char *src, size_t len, int first, int last,
+                            const AsmOptions *opts, int *lo, int *hi, int *m, int *nsrc) {
+    char *work = src ? (char*)malloc(len + 1) : NULL, **lines = NULL, **nam = NULL;
+    int k, ok;
+    if (work) memcpy(work, src, len);
+    *nsrc = work ? split_lines(work, len, &lines) : -1;
+    *m = last - first + 1 + (*nsrc - ss->nsrc);
+    ok = *nsrc >= 0 && first >= 1 && last >= first - 1 && last <= ss->nsrc && *m >= 0;
+    if (ok) {
+        /* each old line: exactly one .am line, not from a macro */
+        int l = 0, h = ss->map.count;
+        while (l < h) { int mid = (l + h) / 2; if (ss->map.lines[mid].src_line < first) l = mid + 1; else h = mid; }
+        *lo = l;
+        *hi = l + (last - first + 1);
+        ok = ss->map.count == ss->nam && *hi <= ss->nam;
+        /* and not inside a mcro block: the line before has output of its own */
+        if (ok && first > 1) ok = l > 0 && ss->map.lines[l - 1].src_line == first - 1;
+        for (k = *lo; ok && k < *hi; k++) {
+            ok = ss->map.lines[k].src_line == first + (k - *lo) && !ss->map.lines[k].macro[0]
+                 && line_is_plain(ss, ss->am[k], opts);
+        }
+    }
+    if (ok) nam = (char**)calloc(*m + 1, sizeof(char*));
+    for (k = 0; nam && k < *m; k++) {
+        char buf[MAX_LINE_LEN];
+        const char *line = lines[first - 1 + k];
+        am_normalize(line, buf, sizeof(buf));
+        nam[k] = strlen(line) < MAX_LINE_LEN - 1 && line_is_plain(ss, buf, opts) ? strdup(buf) : NULL;
+        if (!nam[k]) {
+            while (k-- > 0) free(nam[k]);
+            free(nam);
+            nam = NULL;
+        }
+    }
+    free(lines);
+    free(work);
+    return nam;
+}
+
+/* First pass over the new lines alone, numbered as in the whole file */
+static AsmState *session_pass1(Session *ss, char **nam, int m, int lo, const AsmOptions *opts) {
+    char am_name[520];
+    AsmState *t = (AsmState*)malloc(sizeof(AsmState));
+    size_t tlen;
+    char *text = lines_join(nam, m, &tlen);
+    if (!t || (m && !text)) { free(t); free(text); return NULL; }
+    sprintf(am_name, "%s.am", ss->base);
+    state_init(t);
+    diag_init(&t->diag, am_name, opts->max_errors);
+    t->wide = ss->st->wide;
+    t->track = 1;
+    t->line_base = lo;
+    if (text) {
+        FILE *fp = fmemopen(text, tlen, "r");
+        diag_bind(&t->diag);
+        if (fp) { first_pass(fp, t); fclose(fp); }
+        else asm_error(t, 0, "out of memory");
+        diag_bind(NULL);
+    } else {
+        line_addr(t);
+    }
+    free(text);
+    return t;
+}
+
+/* Splice the re-lexed lines into the last run: drop the old lines' labels,
+   shift symbols after them, move the code tail, encode the new lines in the
+   gap and re-resolve label operands. Returns -1, before changing anything,
+   if only a full run can handle the edit. */
+static int session_splice(Session *ss, AsmState *t, char **nam, int m, int lo, int hi,
+                          int first, int nsrc, const AsmOptions *opts) {
+    AsmState *st = ss->st;
+    LineAddr a0 = st->addrs[lo], a1 = st->addrs[hi];
+    int old_ic = st->ic;
+    int dic = t->ic - (a1.ic - a0.ic);
+    int ddc = t->dc - (a1.dc - a0.dc);
+    int dline = m - (hi - lo);
+    int relink = dic || ddc;
+    int k, ok;
+    NameRef *entries = NULL;
+    Sym *s;
+
+    if (old_ic + dic > IMAGE_WORDS) return -1;
+    /* an .entry naming a label of the old lines needs it defined again */
+    for (s = st->symbols; s; s = s->next) {
+        if (s->line > lo && s->line <= hi && (s->attrs & ATTR_ENTRY)) {
+            if (!sym_get(t, s->name)) {
+                while (entries) { NameRef *n = entries->next; free(entries); entries = n; }
+                return -1;
+            }
+            name_push(&entries, s->name, s->line);
+        }
+    }
+    diag_bind(&st->diag);
+
+    /* symbols */
+    {
+        Sym **pp = &st->symbols;
+        while (*pp) {
+            s = *pp;
+            if (s->line > lo && s->line <= hi && !(s->attrs & ATTR_EXTERN)) {
+                Sym **hp = &st->sym_index[sym_hash(s->name)];
+                while (*hp != s) hp = &(*hp)->hnext;
+                *hp = s->hnext;
+                *pp = s->next;
+                free(s);
+                relink = 1;
+                continue;
+            }
+            if (s->attrs & ATTR_CODE) {
+                if (s->value >= machine->base + a1.ic) s->value += dic;
+            } else if (s->attrs & ATTR_DATA) {
+                s->value += dic + (s->value - machine->base - old_ic >= a1.dc ? ddc : 0);
+            }
+            if (s->line > hi) s->line += dline;
+            pp = &s->next;
+        }
+    }
+    /* new labels go where a full run would put them: the list runs from
+       the last definition to the first */
+    for (s = t->symbols; s; s = s->next) {
+        Sym *n, **pp;
+        unsigned b;
+        if (sym_get(st, s->name)) { asm_error(st, s->line, "duplicate symbol '%s'", s->name); continue; }
+        n = (Sym*)malloc(sizeof(Sym));
+        if (!n) { asm_error(st, s->line, "out of memory"); continue; }
+        *n = *s;
+        if (s->attrs & ATTR_CODE) n->value = s->value + a0.ic;
+        else if (s->attrs & ATTR_DATA) n->value = machine->base + old_ic + dic + a0.dc + s->value;
+        for (pp = &st->symbols; *pp && (*pp)->line > n->line; pp = &(*pp)->next) ;
+        n->next = *pp;
+        *pp = n;
+        b = sym_hash(n->name);
+        n->hnext = st->sym_index[b];
+        st->sym_index[b] = n;
+        relink = 1;
     }
+    while (entries) {
+        NameRef *n = entries->next;
+        sym_mark_entry(st, entries->name, entries->line);
+        free(entries);
+        entries = n;
+    }
+
+    /* data image: prefix, new words, suffix */
+    if (a1.dc > a0.dc || t->dc) {
+        AsmState *img = (AsmState*)malloc(sizeof(AsmState));
+        if (!img) asm_error(st, 0, "out of memory");
+        else {
+            state_init(img);
+            data_copy(img, st, 0, a0.dc);
+            data_copy(img, t, 0, t->dc);
+            data_copy(img, st, a1.dc, st->dc - a1.dc);
+            if (img->error_count) asm_error(st, lo + 1, "data image full (%d words); use --stream", IMAGE_WORDS);
+            memcpy(st->data, img->data, img->nwords * sizeof(st->data[0]));
+            memcpy(st->runs, img->runs, img->nruns * sizeof(st->runs[0]));
+            st->nwords = img->nwords;
+            st->nruns = img->nruns;
+            st->dc = img->dc;
+            state_free(img);
+            free(img);
+        }
+    }
+
+    /* code image and holes */
+    {
+        int h0 = 0, h1, ntail;
+        Hole *tail;
+        while (h0 < st->nholes && st->holes[h0].at < a0.ic) h0++;
+        for (h1 = h0; h1 < st->nholes && st->holes[h1].at < a1.ic; h1++) ;
+        ntail = st->nholes - h1;
+        tail = (Hole*)malloc((ntail ? ntail : 1) * sizeof(Hole));
+        if (!tail) asm_error(st, 0, "out of memory");
+        else {
+            size_t tlen;
+            char *text = lines_join(nam, m, &tlen);
+            memcpy(tail, st->holes + h1, ntail * sizeof(Hole));
+            st->nholes = h0;
+            memmove(st->code + a1.ic + dic, st->code + a1.ic, (old_ic - a1.ic) * sizeof(st->code[0]));
+            st->ic = old_ic + dic;
+            if (text) {
+                FILE *fp = fmemopen(text, tlen, "r");
+                if (!fp) asm_error(st, 0, "out of memory");
+                else {
+                    st->line_base = lo;
+                    st->ic_base = a0.ic;
+                    second_pass(fp, st);
+                    st->line_base = st->ic_base = 0;
+                    fclose(fp);
+                }
+                free(text);
+            }
+            for (k = 0; k < ntail; k++) hole_add(st, tail[k].at + dic, tail[k].name, tail[k].line + dline);
+            free(tail);
+        }
+    }
+    session_patch(st, relink);
+
+    /* line tables */
+    {
+        int nlines = ss->nam + dline;
+        int cap = (nlines > ss->nam ? nlines : ss->nam) + 1;   /* tails move before any shrink */
+        char **na = (char**)realloc(ss->am, cap * sizeof(char*));
+        LineOrigin *nm;
+        LineAddr *aa;
+        if (na) ss->am = na;
+        nm = (LineOrigin*)realloc(ss->map.lines, cap * sizeof(LineOrigin));
+        if (nm) ss->map.lines = nm;
+        aa = (LineAddr*)realloc(st->addrs, cap * sizeof(LineAddr));
+        if (aa) st->addrs = aa;
+        if (!na || !nm || !aa) {
+            asm_error(st, 0, "out of memory");
+        } else {
+            for (k = lo; k < hi; k++) free(ss->am[k]);
+            memmove(ss->am + lo + m, ss->am + hi, (ss->nam - hi) * sizeof(char*));
+            memmove(ss->map.lines + lo + m, ss->map.lines + hi, (ss->nam - hi) * sizeof(LineOrigin));
+            memmove(st->addrs + lo + m, st->addrs + hi, (ss->nam - hi + 1) * sizeof(LineAddr));
+            for (k = 0; k < m; k++) {
+                ss->am[lo + k] = nam[k];
+                nam[k] = NULL;
+                ss->map.lines[lo + k].src_line = first + k;
+                ss->map.lines[lo + k].macro[0] = '\0';
+                st->addrs[lo + k].ic = t->addrs[k].ic + a0.ic;
+                st->addrs[lo + k].dc = t->addrs[k].dc + a0.dc;
+            }
+            for (k = lo + m; k < nlines; k++) ss->map.lines[k].src_line += nsrc - ss->nsrc;
+            for (k = lo + m; k <= nlines; k++) { st->addrs[k].ic += dic; st->addrs[k].dc += ddc; }
+            ss->nam = ss->map.count = nlines;
+            ss->cap_am = ss->map.cap = st->cap_addrs = cap;
+            st->naddrs = nlines + 1;
+            ss->nsrc = nsrc;
+        }
+    }
+    diag_bind(NULL);
+    ok = !st->error_count && session_write(ss, opts);
+    diag_flush(&st->diag, stderr);
+    session_reply(ss, "incremental", ok, st->error_count);
+    if (!ok) { state_free(st); free(st); ss->st = NULL; }   /* the next request starts over */
+    return ok;
+}
+
+/* Bring the session up to src (owned from here on), whose lines first..last
+   replace those of the last version */
+static int session_apply(Session *ss, char *src, size_t len, int first, int last, const AsmOptions *opts) {
+    char **nam = NULL;
+    int lo = 0, hi = 0, m = 0, nsrc = 0, k, ok = -1;
+    AsmState *t = NULL;
+    if (ss->st) nam = session_lines(ss, src, len, first, last, opts, &lo, &hi, &m, &nsrc);
+    if (nam) t = session_pass1(ss, nam, m, lo, opts);
+    if (t && t->error_count) {
+        /* errors in the new lines: report them; the old state no longer matches.
+           Those lines are plain source lines first.. (session_lines) */
+        char as_name[520];
+        SrcMap map;
+        map.count = map.cap = m;
+        map.lines = (LineOrigin*)calloc(m ? m : 1, sizeof(LineOrigin));
+        for (k = 0; map.lines && k < m; k++) map.lines[k].src_line = first + k;
+        if (!map.lines) map.count = 0;
+        sprintf(as_name, "%s.as", ss->base);
+        diag_origin(&t->diag, as_name, &map, lo);
+        diag_flush(&t->diag, stderr);
+        free(map.lines);
+        session_reply(ss, "incremental", 0, t->error_count);
+        state_free(ss->st);
+        free(ss->st);
+        ss->st = NULL;
+        ok = 0;
+    } else if (t) {
+        ok = session_splice(ss, t, nam, m, lo, hi, first, nsrc, opts);
+    }
+    if (t) { state_free(t); free(t); }
+    if (nam) { for (k = 0; k < m; k++) free(nam[k]); free(nam); }
+    if (ok < 0) {
+        free(src);
+        return session_full(ss, opts);
+    }
+    free(ss->src);
+    ss->src = src;
+    ss->src_len = len;
+    return ok;
+}
+
+static int session_edit(Session *ss, int first, int last, const AsmOptions *opts) {
+    char as_name[520];
+    size_t len;
+    char *src;
+    sprintf(as_name, "%s.as", ss->base);
+    src = read_all(as_name, &len);
+    return session_apply(ss, src, len, first, last, opts);
+}
+
+/* Commands, one per line on stdin:
+     asm BASE               assemble BASE.as and keep it warm
+     edit BASE FIRST LAST   BASE.as lines FIRST..LAST changed (LAST = FIRST-1: inserted)
+     drop BASE              forget BASE
+     quit
+   Each command answers with one line on stdout. */
+static int serve(const AsmOptions *opts) {
+    char cmd[1100];
+    Session *list = NULL;
+    while (fgets(cmd, sizeof(cmd), stdin)) {
+        char verb[16], base[512];
+        int first, last, n;
+        Session *ss, **pp;
+        n = sscanf(cmd, "%15s %511s %d %d", verb, base, &first, &last);
+        if (n < 1) continue;
+        if (strcmp(verb, "quit") == 0) break;
+        if (n == 2 && strcmp(verb, "drop") == 0) {
+            for (pp = &list; *pp && strcmp((*pp)->base, base) != 0; pp = &(*pp)->next) ;
+            if ((ss = *pp) != NULL) { *pp = ss->next; session_free(ss); }
+            printf("%s: dropped\n", base);
+        } else if ((n == 2 && strcmp(verb, "asm") == 0) || (n == 4 && strcmp(verb, "edit") == 0)) {
+            ss = session_get(&list, base);
+            if (!ss) printf("%s: failed, out of memory\n", base);
+            else if (verb[0] == 'a') session_full(ss, opts);
+            else session_edit(ss, first, last, opts);
+        } else {
+            printf("error: unknown command\n");
+        }
+        fflush(stdout);
+    }
+    while (list) { Session *n = list->next; session_free(list); list = n; }
+    return 1;
+}
+
+/* ---- watch mode (--watch) ---- */
 
+#define WATCH_QUIET_MS 100   /* a batch starts once saves pause this long */
+
+static int count_lines(const char *s, size_t len) {
+    int n = 0;
+    size_t i;
+    for (i = 0; i < len; i++) if (s[i] == '\n') n++;
+    return n + (len && s[len - 1] != '\n');
+}
+
+/* The lines first..last of text a that text b replaces, in session_apply's
+   terms; 0 if the texts are equal */
+static int text_diff(const char *a, size_t alen, const char *b, size_t blen, int *first, int *last) {
+    size_t p = 0, j = 0, lim, s;
+    if (alen == blen && memcmp(a, b, alen) == 0) return 0;
+    while (p < alen && p < blen && a[p] == b[p]) p++;
+    while (p > 0 && a[p - 1] != '\n') p--;
+    lim = (alen < blen ? alen : blen) - p;
+    while (j < lim && a[alen - 1 - j] == b[blen - 1 - j]) j++;
+    /* the common tail counts from a line start in both texts */
+    for (s = alen - j; s < alen; s++) {
+        size_t bs = s + blen - alen;
+        if ((s == 0 || a[s - 1] == '\n') && (bs == 0 || b[bs - 1] == '\n')) break;
+    }
+    *first = count_lines(a, p) + 1;
+    *last = count_lines(a, alen) - count_lines(a + s, alen - s);
+    return 1;
+}
+
+/* Tell the files that .extern name from ss that its entry changed
+   (from/to -1: no such entry) */
+static void watch_flag(const Session *list, const Session *ss, const char *name, int from, int to) {
+    const Session *o;
+    const NameRef *r;
+    int n = 0;
+    for (o = list; o; o = o->next) {
+        if (o == ss) continue;
+        for (r = o->imports; r && strcmp(r->name, name) != 0; r = r->next) ;
+        if (!r) continue;
+        if (!n++) {
+            printf("%s: entry %s ", ss->base, name);
+            if (from < 0) printf("added");
+            else if (to < 0) printf("removed");
+            else printf("moved %d -> %d", from, to);
+            printf(", relink:");
+        }
+        printf(" %s", o->base);
+    }
+    if (n) printf("\n");
+}
+
+static const Export *export_get(const Export *e, const char *name) {
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+/* Compare ss's entries against those it had before, flagging dependents */
+static void watch_deps(const Session *list, const Session *ss, const Export *old) {
+    const Export *e, *f;
+    for (e = old; e; e = e->next) {
+        f = export_get(ss->exports, e->name);
+        if (!f || f->value != e->value) watch_flag(list, ss, e->name, e->value, f ? f->value : -1);
+    }
+    for (f = ss->exports; f; f = f->next)
+        if (!export_get(old, f->name)) watch_flag(list, ss, f->name, -1, f->value);
+}
+
+/* Record the entries and externs of ss's last good run */
+static void watch_snapshot(Session *list, Session *ss) {
+    Export *old = ss->exports;
+    const Sym *s;
+    ss->exports = NULL;
+    while (ss->imports) { NameRef *n = ss->imports->next; free(ss->imports); ss->imports = n; }
+    for (s = ss->st->symbols; s; s = s->next) {
+        if (s->attrs & ATTR_ENTRY) {
+            Export *e = (Export*)malloc(sizeof(Export));
+            if (!e) continue;
+            e->name[0] = '\0';
+            strncat(e->name, s->name, sizeof(e->name) - 1);
+            e->value = s->value;
+            e->next = ss->exports;
+            ss->exports = e;
+        }
+        if (s->attrs & ATTR_EXTERN) name_push(&ss->imports, s->name, s->line);
+    }
+    if (ss->built) watch_deps(list, ss, old);
+    ss->built = 1;
+    export_free(old);
+}
+
+/* Forget a deleted file; files using its entries need a relink */
+static void watch_drop(Session **list, const char *base) {
+    Session **pp, *ss;
+    Export *old;
+    for (pp = list; *pp && strcmp((*pp)->base, base) != 0; pp = &(*pp)->next) ;
+    if ((ss = *pp) == NULL) return;
+    old = ss->exports;
+    ss->exports = NULL;
+    if (ss->built) watch_deps(*list, ss, old);
+    ss->exports = old;
+    *pp = ss->next;
+    session_free(ss);
+    printf("%s: removed\n", base);
+}
+
+/* Reassemble one changed file: only the lines that differ when it is warm */
+static void watch_build(Session **list, const char *base, const AsmOptions *opts) {
+    char as_name[520];
+    Session *ss;
+    size_t len;
+    char *src;
+    int first, last;
+    sprintf(as_name, "%s.as", base);
+    src = read_all(as_name, &len);
+    if (!src) { watch_drop(list, base); return; }   /* deleted or renamed away */
+    ss = session_get(list, base);
+    if (!ss) { printf("%s: failed, out of memory\n", base); free(src); return; }
+    if (!ss->st || !ss->src) {
+        free(src);
+        session_full(ss, opts);
+    } else if (text_diff(ss->src, ss->src_len, src, len, &first, &last)) {
+        session_apply(ss, src, len, first, last, opts);
+    } else {
+        free(src);
+        printf("%s: unchanged\n", base);
+        return;
+    }
+    if (ss->st) watch_snapshot(*list, ss);
+}
+
+/* A .as name in the watched directory: its base, or 0 */
+static int watch_base(const char *dir, const char *name, char *base, size_t size) {
+    size_t n = strlen(name);
+    if (n < 4 || strcmp(name + n - 3, ".as") != 0 || strlen(dir) + n > size - 2) return 0;
+    sprintf(base, "%s/%.*s", dir, (int)(n - 3), name);
     return 1;
 }
 
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
 
+/* Build the queued bases in name order */
+static void watch_batch(Session **list, char **pending, int *npending, const AsmOptions *opts) {
+    int i;
+    qsort(pending, *npending, sizeof(char*), name_cmp);
+    for (i = 0; i < *npending; i++) {
+        watch_build(list, pending[i], opts);
+        free(pending[i]);
+    }
+    *npending = 0;
+    fflush(stdout);
+}
 
+/* Queue base for the next batch, once */
+static int watch_queue(char ***pending, int *npending, int *cap, const char *base) {
+    char *copy;
+    int i;
+    for (i = 0; i < *npending; i++) if (strcmp((*pending)[i], base) == 0) return 1;
+    if (*npending == *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        char **np = (char**)realloc(*pending, ncap * sizeof(char*));
+        if (!np) return 0;
+        *pending = np;
+        *cap = ncap;
+    }
+    copy = (char*)malloc(strlen(base) + 1);
+    if (!copy) return 0;
+    strcpy(copy, base);
+    (*pending)[(*npending)++] = copy;
+    return 1;
+}
+
+/* Assemble every .as in dir, then reassemble the ones that change until
+   the directory goes away. Saves arriving together form one batch. */
+static int watch(const char *dir_arg, const AsmOptions *opts) {
+    char dir[480], base[512];
+    long buf[1024];   /* inotify events, suitably aligned */
+    Session *list = NULL;
+    char **pending = NULL;
+    int npending = 0, cap = 0, fd, live = 1;
+    DIR *d;
+    struct dirent *de;
+    struct pollfd pfd;
+
+    if (strlen(dir_arg) >= sizeof(dir)) { fprintf(stderr, "Error: directory name too long: %s\n", dir_arg); return 0; }
+    strcpy(dir, dir_arg);
+    while (strlen(dir) > 1 && dir[strlen(dir) - 1] == '/') dir[strlen(dir) - 1] = '\0';
+    fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM
+                                             | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        fprintf(stderr, "Error: cannot watch %s\n", dir);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    /* the watch is in place before the scan, so no save is missed */
+    d = opendir(dir);
+    if (!d) { fprintf(stderr, "Error: cannot open %s\n", dir); close(fd); return 0; }
+    while ((de = readdir(d)) != NULL)
+        if (watch_base(dir, de->d_name, base, sizeof(base))) watch_queue(&pending, &npending, &cap, base);
+    closedir(d);
+    watch_batch(&list, pending, &npending, opts);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (live) {
+        ssize_t n;
+        char *p;
+        int r = poll(&pfd, 1, npending ? WATCH_QUIET_MS : -1);
+        if (r == 0) {
+            printf("watch: %d change%s\n", npending, npending == 1 ? "" : "s");
+            watch_batch(&list, pending, &npending, opts);
+            continue;
+        }
+        if (r < 0) break;
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (p = (char*)buf; p < (char*)buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) live = 0;
+            if (ev->len && watch_base(dir, ev->name, base, sizeof(base))) watch_queue(&pending, &npending, &cap, base);
+        }
+    }
+    printf("watch: %s is gone, stopping\n", dir);
+    while (npending) free(pending[--npending]);
+    free(pending);
+    while (list) { Session *n = list->next; session_free(list); list = n; }
+    close(fd);
+    return 1;
+}
+
+/* ---- size report ---- */
+
+/* First pass: start attribution for statement line (label context and kind) */
+static void size_note(AsmState *st, int line, const char *label, const char *tok) {
+    static const char *dirs[] = { ".extern", ".entry", ".data", ".string", ".mat" };
+    SizeReport *r = st->size;
+    SizeLine *l;
+    int i;
+    if (line >= r->cap) {
+        int cap = r->cap ? r->cap : 256;
+        SizeLine *nl;
+        while (cap <= line) cap *= 2;
+        nl = (SizeLine*)realloc(r->lines, cap * sizeof(SizeLine));
+        if (!nl) return;
+        memset(nl + r->cap, 0, (cap - r->cap) * sizeof(SizeLine));
+        r->lines = nl;
+        r->cap = cap;
+    }
+    r->cur = line;
+    if (label) { r->label[0] = '\0'; strncat(r->label, label, sizeof(r->label) - 1); }
+    l = &r->lines[line];
+    strcpy(l->label, r->label[0] ? r->label : "(none)");
+    l->kind[0] = '\0';
+    for (i = 0; i < 5; i++) if (starts_with(tok, dirs[i])) strcpy(l->kind, dirs[i]);
+    if (!l->kind[0]) strncat(l->kind, tok, sizeof(l->kind) - 1);
+}
+static void size_credit(AsmState *st, int words) {
+    SizeReport *r = st->size;
+    if (r->cur > 0 && r->cur < r->cap) r->lines[r->cur].words += words;
+}
+
+typedef struct {
+    char key[80];
+    int words;
+} SizeAgg;
+
+static int size_cmp_key(const void *a, const void *b) {
+    return strcmp(((const SizeAgg*)a)->key, ((const SizeAgg*)b)->key);
+}
+static int size_cmp_words(const void *a, const void *b) {
+    const SizeAgg *x = (const SizeAgg*)a, *y = (const SizeAgg*)b;
+    if (x->words != y->words) return y->words - x->words;
+    return strcmp(x->key, y->key);
+}
+/* Merge equal keys and order by words, largest first; returns the new count */
+static int size_rank(SizeAgg *v, int n) {
+    int i, m = 0;
+    if (n == 0) return 0;
+    qsort(v, n, sizeof(SizeAgg), size_cmp_key);
+    for (i = 1; i < n; i++) {
+        if (strcmp(v[i].key, v[m].key) == 0) v[m].words += v[i].words;
+        else v[++m] = v[i];
+    }
+    m++;
+    qsort(v, m, sizeof(SizeAgg), size_cmp_words);
+    return m;
+}
+
+#define SIZE_TOP 10
+
+/* Text summary on stdout, full table as "category\tkey\twords" in <base>.size */
+static void size_write(const char *base, AsmState *st) {
+    static const char *titles[4] = { "source lines", "macros", "labels", "directives and opcodes" };
+    static const char *cats[4] = { "line", "macro", "label", "statement" };
+    SizeReport *r = st->size;
+    SizeAgg *agg[4];
+    int n[4] = { 0, 0, 0, 0 };
+    int line, c, i;
+    char path[520];
+    FILE *fp;
+    for (c = 0; c < 4; c++) {
+        agg[c] = (SizeAgg*)calloc(r->cap ? r->cap : 1, sizeof(SizeAgg));
+        if (!agg[c]) {
+            while (c-- > 0) free(agg[c]);
+            fprintf(stderr, "Error: out of memory\n");
+            return;
+        }
+    }
+    for (line = 1; line < r->cap; line++) {
+        const SizeLine *l = &r->lines[line];
+        const LineOrigin *o = line <= r->map.count ? &r->map.lines[line-1] : NULL;
+        if (!l->words) continue;
+        if (o && o->macro[0]) sprintf(agg[0][n[0]].key, "%d (%.60s)", o->src_line, o->macro);
+        else sprintf(agg[0][n[0]].key, "%d", o ? o->src_line : line);
+        agg[0][n[0]++].words = l->words;
+        if (o && o->macro[0]) {
+            strcpy(agg[1][n[1]].key, o->macro);
+            agg[1][n[1]++].words = l->words;
+        }
+        strcpy(agg[2][n[2]].key, l->label);
+        agg[2][n[2]++].words = l->words;
+        strcpy(agg[3][n[3]].key, l->kind);
+        agg[3][n[3]++].words = l->words;
+    }
+    printf("%s: size report, %d code + %d data words\n", base, st->ic, st->dc);
+    for (c = 0; c < 4; c++) {
+        n[c] = size_rank(agg[c], n[c]);
+        printf("  top %s:\n", titles[c]);
+        for (i = 0; i < n[c] && i < SIZE_TOP; i++) printf("    %6d  %s\n", agg[c][i].words, agg[c][i].key);
+    }
+    sprintf(path, "%.500s.size", base);
+    fp = out_open(st->outs, OUT_SIZE, path);
+    if (!fp) fprintf(stderr, "Error: cannot create %s\n", path);
+    else {
+        fprintf(fp, "category\tkey\twords\n");
+        for (c = 0; c < 4; c++)
+            for (i = 0; i < n[c]; i++) fprintf(fp, "%s\t%s\t%d\n", cats[c], agg[c][i].key, agg[c][i].words);
+        fclose(fp);
+    }
+    for (c = 0; c < 4; c++) free(agg[c]);
+}
+
+/* ---- unreferenced data elimination (--gc-data) ---- */
+
+/* First pass: a data directive starts a block when labelled (or when it is
+   the first data in the file); otherwise it extends the previous block. */
+static void gc_block(AsmState *st, const char *label, int line) {
+    Sym *s = label ? sym_get(st, label) : NULL;
+    if (s && !((s->attrs & ATTR_DATA) && s->value == st->dc)) s = NULL; /* duplicate label */
+    if (!label && st->nblocks) return;
+    if (st->nblocks == st->cap_blocks) {
+        int cap = st->cap_blocks ? st->cap_blocks * 2 : 64;
+        GcBlock *nb = (GcBlock*)realloc(st->blocks, cap * sizeof(GcBlock));
+        if (!nb) { st->gc = 0; fprintf(stderr, "Error: out of memory, --gc-data disabled\n"); return; }
+        st->blocks = nb;
+        st->cap_blocks = cap;
+    }
+    st->blocks[st->nblocks].start = st->dc;
+    st->blocks[st->nblocks].line = line;
+    st->blocks[st->nblocks].sym = s;
+    st->nblocks++;
+}
+static void gc_ref(AsmState *st, const char *name) {
+    name_push(&st->refs, name, 0);
+}
+static void name_push(NameRef **list, const char *name, int line) {
+    NameRef *r = (NameRef*)malloc(sizeof(NameRef));
+    if (!r) return;
+    r->name[0] = '\0';
+    strncat(r->name, name, sizeof(r->name) - 1);
+    r->line = line;
+    r->next = *list;
+    *list = r;
+}
+
+/* Re-append words [off, off+count) of the old image (w < 0: zero run),
+   skipping dropped blocks; *bi is a cursor into the block list. */
+static void gc_copy(AsmState *st, const char *keep, int old_dc, int *bi, int off, int count, int w) {
+    while (count > 0) {
+        int end, len;
+        while (*bi + 1 < st->nblocks && st->blocks[*bi + 1].start <= off) (*bi)++;
+        end = *bi + 1 < st->nblocks ? st->blocks[*bi + 1].start : old_dc;
+        len = end - off < count ? end - off : count;
+        if (keep[*bi]) {
+            if (w < 0) data_zero(st, len, 0);
+            else data_word(st, (unsigned short)w, 0);
+        }
+        off += len;
+        count -= len;
+    }
+}
+
+/* Drop labelled data blocks with no operand reference and no .entry, compact
+   the data image and shift the data labels behind them. Runs after
+   first_pass (values are still DC-relative); returns the words removed. */
+static int gc_data(AsmState *st) {
+    NameRef *r;
+    char *keep;
+    int b, removed = 0, old_dc = st->dc, bi = 0;
+    SizeReport *size = st->size;
+    if (!st->nblocks) return 0;
+    for (r = st->refs; r; r = r->next) {
+        Sym *s = sym_get(st, r->name);
+        if (s) s->refd = 1;
+    }
+    keep = (char*)malloc(st->nblocks);
+    if (!keep) return 0;
+    for (b = 0; b < st->nblocks; b++) {
+        const GcBlock *k = &st->blocks[b];
+        int end = b + 1 < st->nblocks ? st->blocks[b + 1].start : st->dc;
+        keep[b] = !k->sym || k->sym->refd;
+        if (keep[b]) { if (k->sym) k->sym->value -= removed; }
+        else removed += end - k->start;
+    }
+    if (!removed) { free(keep); return 0; }
+
+    /* take back the size report credits of the dropped blocks' data lines */
+    for (b = 0; size && b < st->nblocks; b++) {
+        int line, end = b + 1 < st->nblocks ? st->blocks[b + 1].line : size->cap;
+        if (keep[b]) continue;
+        for (line = st->blocks[b].line; line < end && line < size->cap; line++) {
+            SizeLine *l = &size->lines[line];
+            if (!strcmp(l->kind, ".data") || !strcmp(l->kind, ".string") || !strcmp(l->kind, ".mat")) l->words = 0;
+        }
+    }
+
+    /* rebuild the image from the old one, skipping dropped blocks */
+    st->size = NULL;
+    st->dc = 0;
+    if (st->stream) {
+        FILE *old;
+        int rec, off = 0;
+        spill_flush(st);
+        old = st->spill;
+        st->spill = tmpfile();
+        if (!st->spill) {
+            fprintf(stderr, "Error: cannot create spill file\n");
+            st->spill = old;
+            st->error_count++;
+            free(keep);
+            st->size = size;
+            return 0;
+        }
+        rewind(old);
+        while (fread(&rec, sizeof(rec), 1, old) == 1) {
+            if (rec < 0) { gc_copy(st, keep, old_dc, &bi, off, -rec, -1); off += -rec; }
+            else { gc_copy(st, keep, old_dc, &bi, off, 1, rec); off++; }
+        }
+        fclose(old);
+    } else {
+        DataRun *runs = (DataRun*)malloc(st->nruns * sizeof(DataRun));
+        unsigned short *words = (unsigned short*)malloc((st->nwords ? st->nwords : 1) * sizeof(unsigned short));
+        int nruns = st->nruns, i, j;
+        if (!runs || !words) {
+            free(runs); free(words); free(keep);
+            st->dc = old_dc;
+            st->size = size;
+            fprintf(stderr, "Error: out of memory, --gc-data skipped\n");
+            return 0;
+        }
+        memcpy(runs, st->runs, nruns * sizeof(DataRun));
+        memcpy(words, st->data, st->nwords * sizeof(unsigned short));
+        st->nruns = 0;
+        st->nwords = 0;
+        for (i = 0; i < nruns; i++) {
+            if (runs[i].first < 0) gc_copy(st, keep, old_dc, &bi, runs[i].offset, runs[i].count, -1);
+            else for (j = 0; j < runs[i].count; j++)
+                gc_copy(st, keep, old_dc, &bi, runs[i].offset + j, 1, words[runs[i].first + j]);
+        }
+        free(runs);
+        free(words);
+    }
+    st->size = size;
+    free(keep);
+    return removed;
+}
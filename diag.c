@@ -0,0 +1,147 @@
+/* MMN 14 Assembler diagnostics sink */
+#define _POSIX_C_SOURCE 200809L   /* vsnprintf, pthreads */
+#include "diag.h"
+#include "globals.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct DiagMsg {
+    int level;
+    int line;          /* first occurrence */
+    int last_line;     /* latest repeat */
+    int repeats;       /* identical messages after the first */
+    unsigned hash;
+    char *text;
+    DiagMsg *next;     /* report order */
+    DiagMsg *hnext;    /* chain in Diag.index */
+};
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t current_key;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void current_init(void) {
+    pthread_key_create(&current_key, NULL);
+}
+
+static unsigned text_hash(int level, const char *s) {
+    unsigned h = 2166136261u ^ (unsigned)level;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+void diag_init(Diag *d, const char *file, int max_errors) {
+    memset(d, 0, sizeof(*d));
+    if (file) strncat(d->file, file, sizeof(d->file) - 1);
+    d->max_errors = max_errors;
+}
+
+void diag_origin(Diag *d, const char *file, const struct SrcMap *map, int base) {
+    d->file[0] = '\0';
+    if (file) strncat(d->file, file, sizeof(d->file) - 1);
+    d->map = map;
+    d->map_base = base;
+}
+
+/* Source line of line, and the macro it came from ("" if none) */
+static int diag_line(const Diag *d, int line, const char **macro) {
+    int k = line - d->map_base - 1;
+    *macro = "";
+    if (!d->map || line <= 0 || k < 0 || k >= d->map->count) return line;
+    *macro = d->map->lines[k].macro;
+    return d->map->lines[k].src_line;
+}
+
+void diag_free(Diag *d) {
+    DiagMsg *m = d->head;
+    while (m) { DiagMsg *n = m->next; free(m->text); free(m); m = n; }
+    d->head = d->tail = NULL;
+    memset(d->index, 0, sizeof(d->index));
+}
+
+int diag_full(const Diag *d) {
+    return d->max_errors > 0 && d->errors >= d->max_errors;
+}
+
+void diag_vreport(Diag *d, int level, int line, const char *fmt, va_list ap) {
+    char buf[512];
+    unsigned h;
+    DiagMsg *m;
+    if (level != DIAG_NOTE && diag_full(d)) {
+        if (level == DIAG_ERROR) { d->errors++; d->dropped++; }
+        return;
+    }
+    if (level == DIAG_ERROR) d->errors++;
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    h = text_hash(level, buf);
+    if (level != DIAG_NOTE) {
+        for (m = d->index[h % DIAG_BUCKETS]; m; m = m->hnext) {
+            if (m->hash == h && m->level == level && strcmp(m->text, buf) == 0) {
+                m->repeats++;
+                m->last_line = line;
+                return;
+            }
+        }
+    }
+    m = (DiagMsg*)calloc(1, sizeof(DiagMsg));
+    if (m) m->text = (char*)malloc(strlen(buf) + 1);
+    if (!m || !m->text) {
+        /* keep the message even if it cannot be buffered */
+        free(m);
+        fprintf(stderr, "%s\n", buf);
+        return;
+    }
+    strcpy(m->text, buf);
+    m->level = level;
+    m->line = m->last_line = line;
+    m->hash = h;
+    if (level != DIAG_NOTE) {
+        m->hnext = d->index[h % DIAG_BUCKETS];
+        d->index[h % DIAG_BUCKETS] = m;
+    }
+    if (d->tail) d->tail->next = m; else d->head = m;
+    d->tail = m;
+}
+
+void diag_report(Diag *d, int level, int line, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vreport(d, level, line, fmt, ap);
+    va_end(ap);
+}
+
+void diag_flush(Diag *d, FILE *out) {
+    const DiagMsg *m;
+    const char *macro, *last_macro;
+    pthread_mutex_lock(&flush_lock);
+    for (m = d->head; m; m = m->next) {
+        int line = diag_line(d, m->line, &macro);
+        if (m->level == DIAG_NOTE) { fprintf(out, "%s\n", m->text); continue; }
+        if (d->file[0]) fprintf(out, "%s:", d->file);
+        if (line > 0) fprintf(out, "[%d] ", line);
+        else if (d->file[0]) fputc(' ', out);
+        fprintf(out, "%s: %s", m->level == DIAG_ERROR ? "error" : "warning", m->text);
+        if (macro[0]) fprintf(out, " (in macro %s)", macro);
+        if (m->repeats) fprintf(out, " (%d more, last at line %d)", m->repeats, diag_line(d, m->last_line, &last_macro));
+        fputc('\n', out);
+    }
+    if (diag_full(d)) {
+        fprintf(out, "%s%stoo many errors, stopped after %d", d->file, d->file[0] ? ": " : "", d->max_errors);
+        if (d->dropped) fprintf(out, " (%d more not shown)", d->dropped);
+        fputc('\n', out);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&flush_lock);
+    diag_free(d);
+}
+
+void diag_bind(Diag *d) {
+    pthread_once(&current_once, current_init);
+    pthread_setspecific(current_key, d);
+}
+
+Diag *diag_current(void) {
+    pthread_once(&current_once, current_init);
+    return (Diag*)pthread_getspecific(current_key);
+}
@@ -0,0 +1,53 @@
+/* MMN 14 Assembler diagnostics sink */
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Messages of one assembly context (one source file) are buffered with
+   their line and printed together by diag_flush, so contexts assembled on
+   different threads never interleave. A message identical to an earlier
+   one is not stored again; the first copy counts the repeats. */
+enum { DIAG_ERROR, DIAG_WARNING, DIAG_NOTE };   /* notes print as plain text */
+
+typedef struct DiagMsg DiagMsg;
+struct SrcMap;   /* globals.h */
+
+#define DIAG_BUCKETS 256
+
+typedef struct {
+    char file[512];        /* prefixed to every message; "" for none */
+    int max_errors;        /* 0: no limit */
+    int errors;            /* errors reported, repeats included */
+    int dropped;           /* errors past max_errors */
+    DiagMsg *head, *tail;  /* distinct messages in report order */
+    DiagMsg *index[DIAG_BUCKETS];
+    const struct SrcMap *map;  /* set by diag_origin */
+    int map_base;
+} Diag;
+
+void diag_init(Diag *d, const char *file, int max_errors);
+void diag_free(Diag *d);
+
+/* Report lines of expanded (.am) text under file instead, at the source
+   line and macro map records for them: map->lines[k] is the origin of line
+   base + k + 1. Lines the map does not cover print as they are. */
+void diag_origin(Diag *d, const char *file, const struct SrcMap *map, int base);
+
+/* line 0: message is not tied to a line */
+void diag_report(Diag *d, int level, int line, const char *fmt, ...);
+void diag_vreport(Diag *d, int level, int line, const char *fmt, va_list ap);
+
+/* True once max_errors errors were reported: callers should stop early */
+int diag_full(const Diag *d);
+
+/* Print and discard buffered messages; safe to call from any thread */
+void diag_flush(Diag *d, FILE *out);
+
+/* Sink for code that has no context of its own (utils.c report_error);
+   set per thread, NULL when none is bound */
+void diag_bind(Diag *d);
+Diag *diag_current(void);
+
+#endif /* DIAG_H */
@@ -0,0 +1,100 @@
+/* MMN 14 Assembler instruction table generator.
+   Writes optable.h to stdout: the OpCode enum, and for every [opcode][src mode][dst mode][operand
+   count] the legality, word count, label holes, register-word sharing and
+   the precomputed first word. */
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+typedef struct {
+    const char *name;
+    int operands;
+    const char *src;   /* legal source modes */
+    const char *dst;   /* legal destination modes */
+} OpDef;
+
+static const OpDef defs[] = {
+#define OPCODE(name, operands, src, dst) { #name, operands, src, dst },
+#include "opcodes.def"
+#undef OPCODE
+};
+
+#define NDEFS ((int)(sizeof(defs) / sizeof(defs[0])))
+
+enum { IMM = 0, DIR = 1, MAT = 2, REG = 3 };
+
+/* extra words and label holes for one operand */
+static int operand_words(int mode) { return mode == MAT ? 2 : 1; }
+static int operand_labels(int mode) { return (mode == DIR || mode == MAT) ? 1 : 0; }
+
+static int mode_ok(const char *legal, int mode) {
+    return strchr(legal, '0' + mode) != NULL;
+}
+
+int main(void) {
+    int op, src, dst, n;
+    printf("/* Generated by gen_optable from opcodes.def -- do not edit */\n");
+    printf("#ifndef OPTABLE_H\n#define OPTABLE_H\n\n");
+    printf("typedef struct {\n");
+    printf("    unsigned char legal;     /* opcode accepts these modes and operand count */\n");
+    printf("    unsigned char nwords;    /* words including the first (8-bit addresses) */\n");
+    printf("    unsigned char nlabels;   /* label words; each takes one more word in wide mode */\n");
+    printf("    unsigned char shared;    /* source and destination registers share one word */\n");
+    printf("    unsigned short first;    /* first word, ARE = 00 */\n");
+    printf("} OpInfo;\n\n");
+    printf("#define OP_COUNT %d\n\n", NDEFS);
+    printf("/* opcode values, in opcodes.def order */\ntypedef enum {");
+    for (op = 0; op < NDEFS; op++) {
+        const char *c;
+        printf("%sOP_", op ? ", " : " ");
+        for (c = defs[op].name; *c; c++) putchar(toupper((unsigned char)*c));
+    }
+    printf(", OP_INVALID = 99 } OpCode;\n\n");
+    printf("static const char *const op_names[OP_COUNT] = {");
+    for (op = 0; op < NDEFS; op++) printf("%s\"%s\"", op ? ", " : " ", defs[op].name);
+    printf(" };\n\n");
+    printf("static const unsigned char op_operands[OP_COUNT] = {");
+    for (op = 0; op < NDEFS; op++) printf("%s%d", op ? ", " : " ", defs[op].operands);
+    printf(" };\n\n");
+    printf("/* [opcode][source mode][destination mode][operand count]; with fewer than\n");
+    printf("   two operands the unused mode indices are 0 */\n");
+    printf("static const OpInfo op_table[OP_COUNT][4][4][3] = {\n");
+    for (op = 0; op < NDEFS; op++) {
+        const OpDef *d = &defs[op];
+        printf("  { /* %s */\n", d->name);
+        for (src = 0; src < 4; src++) {
+            printf("    {");
+            for (dst = 0; dst < 4; dst++) {
+                printf(" {");
+                for (n = 0; n < 3; n++) {
+                    int legal = 0, words = 1, labels = 0, shared = 0;
+                    unsigned first = 0;
+                    if (n == d->operands) {
+                        if (n == 2) {
+                            legal = mode_ok(d->src, src) && mode_ok(d->dst, dst);
+                            shared = (src == REG && dst == REG);
+                            words += shared ? 1 : operand_words(src) + operand_words(dst);
+                            labels = operand_labels(src) + operand_labels(dst);
+                            first = (op << 6) | (src << 4) | (dst << 2);
+                        } else if (n == 1) {
+                            legal = src == 0 && mode_ok(d->dst, dst);
+                            words += operand_words(dst);
+                            labels = operand_labels(dst);
+                            first = (op << 6) | (dst << 2);
+                        } else {
+                            legal = src == 0 && dst == 0;
+                            first = op << 6;
+                        }
+                    }
+                    if (!legal) { words = 1; labels = 0; shared = 0; first = 0; }
+                    printf("%s{%d,%d,%d,%d,0x%03X}", n ? "," : "", legal, words, labels, shared, first & 0x3FFu);
+                }
+                printf("}%s", dst < 3 ? "," : "");
+            }
+            printf(" }%s\n", src < 3 ? "," : "");
+        }
+        printf("  }%s\n", op < NDEFS - 1 ? "," : "");
+    }
+    printf("};\n\n#endif /* OPTABLE_H */\n");
+    return 0;
+}
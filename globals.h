@@ -52,12 +52,25 @@ typedef struct SymNode {
 char *strdup(const char *s);
 void build_new_file_name(char *str, char *newExt);
 
-/* Preassembler API implemented in preassembler.c */
+/* Origin of each .am line, recorded by process_file when a map is given */
+typedef struct {
+    int src_line;      /* line in the .as file */
+    char macro[64];    /* macro the line was expanded from, "" if none */
+} LineOrigin;
+
+typedef struct SrcMap {
+    LineOrigin *lines; /* indexed by .am line - 1 */
+    int count;
+    int cap;
+} SrcMap;
+
+/* Preassembler API implemented in preassembler.c (lib: see macrolib.h, map: may be NULL) */
+struct MacroLib;
 macro *make_macro(FILE *fp);
 void add_macro(macro **head, const char *name, const char *data);
 char *find_macro_data(macro *head, const char *name);
 void replace_macros_in_line(char *line, macro *macros, char *output);
-void process_file(FILE *in, FILE *out, macro *macros);
+void process_file(FILE *in, FILE *out, macro *macros, const struct MacroLib *lib, SrcMap *map);
 
 #endif /* GLOBALS_H */
 
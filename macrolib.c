@@ -0,0 +1,283 @@
+#define _XOPEN_SOURCE 700   /* POSIX 2008 with realpath */
+/* MMN 14 Assembler precompiled macro libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "globals.h"
+#include "macrolib.h"
+
+/* File layout (native byte order, all offsets from the start of the file):
+     MlibHeader
+     unsigned int buckets[nbuckets]   offset of the first MlibEntry, 0 = empty
+     MlibEntry entries[nentries]
+     string area: absolute source path, then name/body pairs, all NUL-terminated */
+#define MLIB_MAGIC "MMNMLIB1"
+
+typedef struct {
+    char magic[8];
+    unsigned int nbuckets;
+    unsigned int nentries;
+    unsigned int src_hash;   /* FNV-1a of the source the library was built from */
+    unsigned int src_off;    /* offset of the source path */
+} MlibHeader;
+
+typedef struct {
+    unsigned int next;       /* next entry in the bucket chain, 0 = end */
+    unsigned int name_off;
+    unsigned int body_off;
+    unsigned int body_len;
+} MlibEntry;
+
+struct MacroLib {
+    const unsigned char *base;
+    size_t size;
+    const MlibHeader *hdr;
+    int mapped;              /* base is an mmap of the file, else malloc'ed */
+};
+
+static unsigned int fnv1a(const unsigned char *p, size_t n) {
+    unsigned long h = 2166136261UL;
+    size_t i;
+    for (i = 0; i < n; i++) h = ((h ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    return (unsigned int)h;
+}
+
+/* Content hash of a file; returns 0 if it cannot be read */
+static int hash_file(const char *path, unsigned int *out) {
+    FILE *fp = fopen(path, "rb");
+    unsigned long h = 2166136261UL;
+    int c;
+    if (!fp) return 0;
+    while ((c = getc(fp)) != EOF) h = ((h ^ (unsigned long)c) * 16777619UL) & 0xFFFFFFFFUL;
+    fclose(fp);
+    *out = (unsigned int)h;
+    return 1;
+}
+
+static void free_macros(macro *m) {
+    while (m) {
+        macro *n = m->next;
+        free(m->mc_name); free(m->mc_data); free(m);
+        m = n;
+    }
+}
+
+/* The library image of src, built in memory; NULL (after printing an
+   error) on failure */
+static char *mlib_image(const char *src, size_t *len) {
+    FILE *in, *out;
+    macro *macros, *m;
+    MlibHeader hdr;
+    unsigned int *buckets;
+    MlibEntry *entries;
+    const char **names;
+    unsigned int n = 0, i, off, strings;
+    char *img = NULL;
+    int ok;
+
+    in = fopen(src, "r");
+    if (!in) { fprintf(stderr, "Error: cannot open %s\n", src); return NULL; }
+    macros = make_macro(in);
+    fclose(in);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MLIB_MAGIC, 8);
+    if (!hash_file(src, &hdr.src_hash)) { fprintf(stderr, "Error: cannot read %s\n", src); free_macros(macros); return NULL; }
+    for (m = macros; m; m = m->next) n++;
+    hdr.nentries = n;
+    hdr.nbuckets = n ? n * 2 : 1;
+
+    buckets = (unsigned int*)calloc(hdr.nbuckets, sizeof(unsigned int));
+    entries = (MlibEntry*)calloc(n ? n : 1, sizeof(MlibEntry));
+    names = (const char**)calloc(n ? n : 1, sizeof(char*));
+    if (!buckets || !entries || !names) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(buckets); free(entries); free(names);
+        free_macros(macros);
+        return NULL;
+    }
+
+    /* lay out strings after the tables */
+    strings = sizeof(hdr) + hdr.nbuckets * sizeof(unsigned int) + n * sizeof(MlibEntry);
+    hdr.src_off = strings;
+    off = strings + (unsigned int)strlen(src) + 1;
+    for (m = macros, i = 0; m; m = m->next, i++) {
+        entries[i].name_off = off;
+        off += (unsigned int)strlen(m->mc_name) + 1;
+        entries[i].body_off = off;
+        entries[i].body_len = (unsigned int)strlen(m->mc_data);
+        off += entries[i].body_len + 1;
+        names[i] = m->mc_name;
+    }
+    /* chain back to front, so each bucket keeps make_macro's order:
+       a later redefinition of a name is found first, as in find_macro_data */
+    for (i = n; i-- > 0; ) {
+        unsigned int b = fnv1a((const unsigned char*)names[i], strlen(names[i])) % hdr.nbuckets;
+        entries[i].next = buckets[b];
+        buckets[b] = sizeof(hdr) + hdr.nbuckets * sizeof(unsigned int) + i * sizeof(MlibEntry);
+    }
+
+    out = open_memstream(&img, len);
+    if (!out) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(buckets); free(entries); free(names);
+        free_macros(macros);
+        return NULL;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(buckets, sizeof(unsigned int), hdr.nbuckets, out);
+    if (n) fwrite(entries, sizeof(MlibEntry), n, out);
+    fwrite(src, 1, strlen(src) + 1, out);
+    for (m = macros; m; m = m->next) {
+        fwrite(m->mc_name, 1, strlen(m->mc_name) + 1, out);
+        fwrite(m->mc_data, 1, strlen(m->mc_data) + 1, out);
+    }
+    ok = !ferror(out);
+    if (fclose(out) != 0) ok = 0;
+    if (!ok) { fprintf(stderr, "Error: out of memory\n"); free(img); img = NULL; }
+
+    free(buckets);
+    free(entries);
+    free(names);
+    free_macros(macros);
+    return img;
+}
+
+/* Write through a temporary of this process's own and rename, so mapped
+   readers never see a partial file and concurrent rebuilds of the same
+   library do not clobber each other's temporaries */
+static int mlib_save(const char *lib_path, const char *img, size_t len) {
+    char tmp_path[520];
+    FILE *out;
+    int fd, ok;
+    sprintf(tmp_path, "%.500s.XXXXXX", lib_path);
+    fd = mkstemp(tmp_path);
+    if (fd < 0) { fprintf(stderr, "Error: cannot create %s\n", tmp_path); return 0; }
+    fchmod(fd, 0644);
+    out = fdopen(fd, "wb");
+    if (!out) { close(fd); remove(tmp_path); fprintf(stderr, "Error: cannot write %s\n", lib_path); return 0; }
+    ok = fwrite(img, 1, len, out) == len;
+    if (fclose(out) != 0) ok = 0;
+    if (ok && rename(tmp_path, lib_path) != 0) ok = 0;
+    if (!ok) { fprintf(stderr, "Error: cannot write %s\n", lib_path); remove(tmp_path); }
+    return ok;
+}
+
+/* The source is recorded by absolute path, so the library can be opened
+   and rebuilt from any working directory */
+int mlib_build(const char *lib_path, const char *src) {
+    char *abs = realpath(src, NULL), *img;
+    size_t len;
+    int ok;
+    if (!abs) { fprintf(stderr, "Error: cannot open %s\n", src); return 0; }
+    img = mlib_image(abs, &len);
+    ok = img && mlib_save(lib_path, img, len);
+    free(img);
+    free(abs);
+    return ok;
+}
+
+static int mlib_valid(const MacroLib *lib) {
+    return lib->size >= sizeof(MlibHeader) && memcmp(lib->hdr->magic, MLIB_MAGIC, 8) == 0 && lib->hdr->nbuckets != 0
+        && sizeof(MlibHeader) + (size_t)lib->hdr->nbuckets * sizeof(unsigned int)
+           + (size_t)lib->hdr->nentries * sizeof(MlibEntry) <= lib->size
+        && lib->hdr->src_off < lib->size && lib->base[lib->size - 1] == '\0';
+}
+
+static MacroLib *mlib_map(const char *lib_path) {
+    MacroLib *lib;
+    struct stat sb;
+    void *p;
+    int fd = open(lib_path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(MlibHeader)) { close(fd); return NULL; }
+    p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    lib = (MacroLib*)malloc(sizeof(MacroLib));
+    if (!lib) { munmap(p, (size_t)sb.st_size); return NULL; }
+    lib->base = (const unsigned char*)p;
+    lib->size = (size_t)sb.st_size;
+    lib->hdr = (const MlibHeader*)p;
+    lib->mapped = 1;
+    if (!mlib_valid(lib)) {
+        mlib_close(lib);
+        return NULL;
+    }
+    return lib;
+}
+
+/* A library over an image built in memory (owned from here on) */
+static MacroLib *mlib_memory(char *img, size_t len) {
+    MacroLib *lib = (MacroLib*)malloc(sizeof(MacroLib));
+    if (!lib) { free(img); fprintf(stderr, "Error: out of memory\n"); return NULL; }
+    lib->base = (const unsigned char*)img;
+    lib->size = len;
+    lib->hdr = (const MlibHeader*)img;
+    lib->mapped = 0;
+    return lib;
+}
+
+MacroLib *mlib_open(const char *lib_path, int rebuild) {
+    MacroLib *lib = mlib_map(lib_path);
+    unsigned int h;
+    char src[1024];
+    const char *rec, *slash;
+    if (!lib) { fprintf(stderr, "Error: %s is not a macro library\n", lib_path); return NULL; }
+    /* the recorded source; a relative one (older libraries) is taken
+       relative to the library's directory, never the working directory */
+    rec = (const char*)lib->base + lib->hdr->src_off;
+    slash = strrchr(lib_path, '/');
+    if (rec[0] != '/' && slash)
+        sprintf(src, "%.*s/%.500s", (int)(slash - lib_path < 500 ? slash - lib_path : 500), lib_path, rec);
+    else
+        sprintf(src, "%.1000s", rec);
+    /* invalidation: rebuild when the recorded source no longer hashes the same */
+    if (!hash_file(src, &h)) {
+        fprintf(stderr, "Warning: %s, the source of %s, cannot be read; using the library as built\n", src, lib_path);
+    } else if (h != lib->hdr->src_hash && !rebuild) {
+        size_t len;
+        char *img;
+        mlib_close(lib);
+        fprintf(stderr, "Note: %s changed, expanding from it without rebuilding %s\n", src, lib_path);
+        img = mlib_image(src, &len);
+        return img ? mlib_memory(img, len) : NULL;
+    } else if (h != lib->hdr->src_hash) {
+        int ok;
+        mlib_close(lib);
+        fprintf(stderr, "Note: %s changed, rebuilding %s\n", src, lib_path);
+        ok = mlib_build(lib_path, src);
+        lib = mlib_map(lib_path);
+        /* another process rebuilding at the same time may have won the
+           rename; its library serves as well if it is current */
+        if (lib && !ok && lib->hdr->src_hash != h) { mlib_close(lib); lib = NULL; }
+        if (!lib) fprintf(stderr, "Error: cannot rebuild %s\n", lib_path);
+    }
+    return lib;
+}
+
+void mlib_close(MacroLib *lib) {
+    if (!lib) return;
+    if (lib->mapped) munmap((void*)lib->base, lib->size);
+    else free((void*)lib->base);
+    free(lib);
+}
+
+const char *mlib_find(const MacroLib *lib, const char *name, size_t *len) {
+    const unsigned int *buckets = (const unsigned int*)(lib->base + sizeof(MlibHeader));
+    unsigned int off = buckets[fnv1a((const unsigned char*)name, strlen(name)) % lib->hdr->nbuckets];
+    while (off && off + sizeof(MlibEntry) <= lib->size) {
+        const MlibEntry *e = (const MlibEntry*)(lib->base + off);
+        if (e->name_off < lib->size && e->body_off + e->body_len < lib->size
+            && strcmp((const char*)lib->base + e->name_off, name) == 0) {
+            *len = e->body_len;
+            return (const char*)lib->base + e->body_off;
+        }
+        off = e->next;
+    }
+    return NULL;
+}
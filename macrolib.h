@@ -0,0 +1,26 @@
+/* MMN 14 Assembler precompiled macro libraries */
+#ifndef MACROLIB_H
+#define MACROLIB_H
+
+#include <stddef.h>
+
+/* A library file holds macro definitions compiled once from a source file:
+   a hash table of names with offsets to the bodies. It is mmap'ed read-only
+   and the preassembler expands straight from the mapping. */
+typedef struct MacroLib MacroLib;
+
+/* Compile the mcro blocks of src into the library file lib_path; src is
+   recorded by absolute path */
+int mlib_build(const char *lib_path, const char *src);
+
+/* Map a library. If its source's content hash changed, rebuilds it first,
+   or without rebuild expands from the source in memory and writes nothing.
+   Warns if the source is gone. Returns NULL (after printing an error) on
+   failure. */
+MacroLib *mlib_open(const char *lib_path, int rebuild);
+void mlib_close(MacroLib *lib);
+
+/* Body of macro name, not NUL-terminated counted by *len; NULL if absent */
+const char *mlib_find(const MacroLib *lib, const char *name, size_t *len);
+
+#endif /* MACROLIB_H */
@@ -1,4 +1,5 @@
 #include "globals.h"
+#include "macrolib.h"
 
 /* simple helpers */
 static int starts_with_kw(const char *s, const char *kw) {
@@ -74,24 +75,83 @@ void replace_macros_in_line(char* line,macro* macros, char* output) {
     strcat(output, "\n");
 }
 
-void process_file(FILE* in, FILE* out, macro* macros) {
+/* Record n .am lines coming from source line src_line (and macro, if any) */
+static void map_lines(SrcMap *map, int src_line, const char *macro_name, int n) {
+    while (n-- > 0) {
+        LineOrigin *o;
+        if (map->count == map->cap) {
+            int cap = map->cap ? map->cap * 2 : 256;
+            LineOrigin *nl = (LineOrigin*)realloc(map->lines, cap * sizeof(LineOrigin));
+            if (!nl) return;
+            map->lines = nl;
+            map->cap = cap;
+        }
+        o = &map->lines[map->count++];
+        o->src_line = src_line;
+        o->macro[0] = '\0';
+        if (macro_name) strncat(o->macro, macro_name, sizeof(o->macro) - 1);
+    }
+}
+static int count_newlines(const char *p, size_t n) {
+    int c = 0;
+    while (n-- > 0) if (*p++ == '\n') c++;
+    return c;
+}
+
+/* Like replace_macros_in_line, but writes straight to out: bodies from a
+   mapped library are copied from the mapping with no intermediate buffer.
+   Returns the number of .am lines written; *from is set to the expanded
+   macro's name (the token inside line), or NULL. */
+static int expand_line(char* line, macro* macros, const MacroLib* lib, FILE* out, const char** from) {
+    char* token = strtok(line, " \t\n");
+    int first = 1;
+    int lines = 1;
+    *from = NULL;
+
+    while (token != NULL) {
+        char* replacement = find_macro_data(macros, token);
+        const char* body = NULL;
+        size_t len = 0;
+        if (!first) fputc(' ', out);
+        first = 0;
+
+        if (replacement) {
+            fputs(replacement, out);
+            lines += count_newlines(replacement, strlen(replacement));
+            *from = token;
+        } else if (lib && (body = mlib_find(lib, token, &len)) != NULL) {
+            fwrite(body, 1, len, out);
+            lines += count_newlines(body, len);
+            *from = token;
+        } else {
+            fputs(token, out);
+        }
+
+        token = strtok(NULL, " \t\n");
+    }
+    fputc('\n', out);
+    return lines;
+}
+
+void process_file(FILE* in, FILE* out, macro* macros, const struct MacroLib* lib, SrcMap* map) {
     char line[MAX_LINE_LEN];
-    char new_line[MAX_LINE_LEN];
+    int src_line = 0;
 
     while (fgets(line, sizeof(line), in)) {
+        const char* from;
+        int n;
+        src_line++;
         /* Skip macro definition blocks in the expanded output */
         if (starts_with_kw(line, "mcro")) {
             /* consume until mcroend (not emitted) */
             while (fgets(line, sizeof(line), in)) {
+                src_line++;
                 if (starts_with_kw(line, "mcroend")) break;
             }
             continue;
         }
 
-        replace_macros_in_line(line, macros, new_line);
-        fputs(new_line, out);
+        n = expand_line(line, macros, lib, out, &from);
+        if (map) map_lines(map, src_line, from, n);
     }
 }
-
-
-
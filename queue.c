@@ -0,0 +1,47 @@
+#define _POSIX_C_SOURCE 200809L
+/* MMN 14 Assembler bounded single-producer/single-consumer queue */
+#include <stdlib.h>
+#include <sched.h>
+#include "queue.h"
+
+int spsc_init(SpscQueue *q, unsigned cap) {
+    q->slots = (void**)calloc(cap, sizeof(void*));
+    if (!q->slots) return 0;
+    q->cap = cap;
+    q->head = 0;
+    q->tail = 0;
+    return 1;
+}
+
+void spsc_free(SpscQueue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+int spsc_try_push(SpscQueue *q, void *item) {
+    unsigned tail = q->tail;
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail - head == q->cap) return 0;
+    q->slots[tail % q->cap] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int spsc_try_pop(SpscQueue *q, void **item) {
+    unsigned head = q->head;
+    unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
+    *item = q->slots[head % q->cap];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void spsc_push(SpscQueue *q, void *item) {
+    while (!spsc_try_push(q, item)) sched_yield();
+}
+
+void *spsc_pop(SpscQueue *q) {
+    void *item;
+    while (!spsc_try_pop(q, &item)) sched_yield();
+    return item;
+}
@@ -0,0 +1,23 @@
+/* MMN 14 Assembler bounded single-producer/single-consumer queue */
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/* Lock-free ring of pointers: exactly one thread pushes, one thread pops.
+   head/tail only grow (wrapping), so cap must be a power of two. */
+typedef struct {
+    void **slots;
+    unsigned cap;
+    unsigned head;   /* next slot to pop (consumer owned) */
+    unsigned tail;   /* next slot to push (producer owned) */
+} SpscQueue;
+
+int spsc_init(SpscQueue *q, unsigned cap);
+void spsc_free(SpscQueue *q);
+int spsc_try_push(SpscQueue *q, void *item);
+int spsc_try_pop(SpscQueue *q, void **item);
+
+/* Blocking forms: yield the CPU while the queue is full / empty */
+void spsc_push(SpscQueue *q, void *item);
+void *spsc_pop(SpscQueue *q);
+
+#endif /* QUEUE_H */
@@ -1,24 +1,21 @@
 #include "globals.h"
 /* MMN 14 Assembler utility functions and error handling implementation */
 #include "utils.h"
+#include "diag.h"
 #include <stdio.h>
 #include <string.h>
 
-#define MAX_ERRORS 100
-
-static char error_list[MAX_ERRORS][MAX_LINE_LENGTH];
 static int error_count = 0;
 
 Symbol symbol_table[100];
 int symbol_count = 0;
 
+/* Goes to the diagnostics sink of the file being assembled, if any */
 void report_error(const char *msg) {
-	if (error_count < MAX_ERRORS) {
-		strncpy(error_list[error_count], msg, MAX_LINE_LENGTH - 1);
-		error_list[error_count][MAX_LINE_LENGTH - 1] = '\0';
-		error_count++;
-	}
-	fprintf(stderr, "Error: %s\n", msg);
+	Diag *d = diag_current();
+	error_count++;
+	if (d) diag_report(d, DIAG_ERROR, 0, "%s", msg);
+	else fprintf(stderr, "Error: %s\n", msg);
 }
 
 int has_errors() {